@@ -0,0 +1,16 @@
+#version 330 core
+
+// output data
+out vec3 color;
+
+// The cached background, same size as the framebuffer
+uniform sampler2D cachedColor;
+uniform sampler2D cachedDepth;
+
+void main()
+{
+    // Copy pixel for pixel, with its depth so moving objects still hide behind the board
+    ivec2 pixel = ivec2(gl_FragCoord.xy);
+    color = texelFetch(cachedColor, pixel, 0).rgb;
+    gl_FragDepth = texelFetch(cachedDepth, pixel, 0).r;
+}
@@ -0,0 +1,32 @@
+#version 330 core
+
+// input data : sent from main program
+layout (location = 0) in vec3 vertexPosition;
+layout (location = 2) in vec2 vertexTexCoord;
+// per instance data : translation in xyz, visibility flag in w
+layout (location = 3) in vec4 instanceOffset;
+
+// Camera matrices, written once per frame by the main program
+layout (std140) uniform Camera
+{
+    mat4 projection;
+    mat4 view;
+    mat4 viewProjection;
+};
+
+// output data : used by fragment shader
+out vec2 fragTexCoord;
+
+void main ()
+{
+    fragTexCoord = vertexTexCoord;
+
+    // Hidden instances collapse to a point outside the clip volume
+    if (instanceOffset.w < 0.5) {
+        gl_Position = vec4(2.0, 2.0, 2.0, 1.0);
+        return;
+    }
+
+    // Instances are only translated, so the model matrix reduces to an offset
+    gl_Position = viewProjection * vec4(vertexPosition + instanceOffset.xyz, 1);
+}
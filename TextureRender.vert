@@ -4,7 +4,17 @@
 layout (location = 0) in vec3 vertexPosition;
 layout (location = 2) in vec2 vertexTexCoord;
 
-uniform mat4 MVP;
+// Camera matrices, written once per frame by the main program
+layout (std140) uniform Camera
+{
+    mat4 projection;
+    mat4 view;
+    mat4 viewProjection;
+};
+
+// Model matrices of this frame's objects, four RGBA32F texels (columns) each
+uniform samplerBuffer objectTransforms;
+uniform int objectIndex;
 
 // output data : used by fragment shader
 out vec2 fragTexCoord;
@@ -17,6 +27,11 @@ void main ()
     // to produce the color of each fragment
     fragTexCoord = vertexTexCoord;
 
-    // Output position of the vertex, in clip space : MVP * position
-    gl_Position = MVP * v;
-}
\ No newline at end of file
+    mat4 model = mat4(texelFetch(objectTransforms, 4 * objectIndex),
+                      texelFetch(objectTransforms, 4 * objectIndex + 1),
+                      texelFetch(objectTransforms, 4 * objectIndex + 2),
+                      texelFetch(objectTransforms, 4 * objectIndex + 3));
+
+    // Output position of the vertex, in clip space : P * V * M * position
+    gl_Position = viewProjection * model * v;
+}
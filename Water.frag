@@ -0,0 +1,19 @@
+#version 330 core
+
+// Interpolated values from the vertex shaders
+in vec2 fragTexCoord1;
+in vec2 fragTexCoord2;
+
+// output data
+out vec3 color;
+
+uniform sampler2D water1;
+uniform sampler2D water2;
+uniform float time;
+
+void main()
+{
+    // Cross fade between the two frames of the animation
+    float blend = 0.5 + 0.5 * sin(time * 1.5);
+    color = mix(texture(water1, fragTexCoord1).rgb, texture(water2, fragTexCoord2).rgb, blend);
+}
@@ -0,0 +1,29 @@
+#version 330 core
+
+// input data : sent from main program, already in world space
+layout (location = 0) in vec3 vertexPosition;
+layout (location = 2) in vec2 vertexTexCoord;
+
+// Camera matrices, written once per frame by the main program
+layout (std140) uniform Camera
+{
+    mat4 projection;
+    mat4 view;
+    mat4 viewProjection;
+};
+
+// Simulated seconds, drives the animation
+uniform float time;
+
+// output data : one coordinate per texture layer
+out vec2 fragTexCoord1;
+out vec2 fragTexCoord2;
+
+void main ()
+{
+    // The layers drift in different directions so the surface never moves as one
+    fragTexCoord1 = vertexTexCoord + vec2(0.05, 0.02) * time;
+    fragTexCoord2 = vertexTexCoord + vec2(-0.03, 0.04) * time;
+
+    gl_Position = viewProjection * vec4(vertexPosition, 1);
+}
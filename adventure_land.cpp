@@ -2,21 +2,42 @@
 #include <cmath>
 #include <fstream>
 #include <vector>
+#include <map>
+#include <algorithm>
+#include <string>
 #include <cstdlib>
+#include <cstring>
+#include <cfloat>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include <time.h>
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define OVERLAP_SIMD_X86
+#include <immintrin.h>
+#endif
 
 #include <glad/glad.h>
 #include <GLFW/glfw3.h>
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
 
 #define GLM_FORCE_RADIANS
 #include <glm/glm.hpp>
 #include <glm/gtx/transform.hpp>
 #include <glm/gtc/matrix_transform.hpp>
 
-#include <FTGL/ftgl.h>
+#include <ft2build.h>
+#include FT_FREETYPE_H
 #include <SOIL/SOIL.h>
 
 #include <SFML/Audio.hpp>
 
+#include "asset_pack.h"
+
 using namespace std;
 float LEFT_BOUND = -72.0f;
 float RIGHT_BOUND = 72.0f;
@@ -36,11 +57,14 @@ struct VAO {
   GLuint VertexBuffer;
   GLuint ColorBuffer;
   GLuint TextureBuffer;
+  GLuint IndexBuffer; // 0 when the object is drawn unindexed
   GLuint TextureID;
 
   GLenum PrimitiveMode; // GL_POINTS, GL_LINE_STRIP, GL_LINE_LOOP, GL_LINES, GL_LINE_STRIP_ADJACENCY, GL_LINES_ADJACENCY, GL_TRIANGLE_STRIP, GL_TRIANGLE_FAN, GL_TRIANGLES, GL_TRIANGLE_STRIP_ADJACENCY and GL_TRIANGLES_ADJACENCY
   GLenum FillMode; // GL_FILL, GL_LINE
   int NumVertices;
+  int NumIndices;
+  GLenum IndexType; // GL_UNSIGNED_SHORT, GL_UNSIGNED_INT
 };
 typedef struct VAO VAO;
 
@@ -49,44 +73,249 @@ struct GLMatrices {
   glm::mat4 model;
   glm::mat4 view;
   GLuint MatrixID; // For use with normal shader
-  GLuint TexMatrixID; // For use with texture shader
+  GLuint CameraBuffer; // "Camera" uniform block of the texture shaders
 };
 typedef struct GLMatrices GLMatrices;
 
 GLMatrices Matrices;
-GLuint programID, fontProgramID, textureProgramID;
-GLint fontVertexCoordAttrib, fontVertexNormalAttrib, fontVertexOffsetUniform;
+int staticGeometryVersion = 0; // Bumped whenever a cuboid's visible/empty/sliding state changes
+GLuint programID, fontProgramID, textureProgramID, textureInstancedProgramID, waterProgramID, backgroundProgramID;
 
 //forward declarations
 class Villain;
 class Bonus;
+class InstancedBatch;
+class BoardMesh;
+
+struct AABB {
+  glm::vec3 min;
+  glm::vec3 max;
+};
+
+/* Six clip planes (a,b,c,d), normals pointing inwards */
+struct Frustum {
+  glm::vec4 planes[6];
+};
+
+enum FrustumTest {
+  FRUSTUM_OUTSIDE,
+  FRUSTUM_INTERSECT,
+  FRUSTUM_INSIDE
+};
+
+Frustum extractFrustum(const glm::mat4 &viewProjection);
+FrustumTest testFrustum(const Frustum &frustum, const AABB &box);
 
+/* Objects submitted vs rejected by frustum culling, reset every frame */
+struct CullStats {
+  int drawn;
+  int culled;
+  int lastDrawn;
+  int lastCulled;
+};
+
+/* Printable ASCII of one face, rasterized once into a single texture.
+   Metrics are in font pixels, y up from the baseline. */
+class GlyphAtlas{
+public:
+  GlyphAtlas(const char *fontfile, int pixelSize);
+  ~GlyphAtlas();
+  struct Glyph {
+    float u0, v0, u1, v1;
+    int width, height;
+    int bearingX, bearingY;
+    int advance;
+  };
+  const Glyph& getGlyph(char c);
+  GLuint getTextureID();
+  static const int FIRST_CHAR = 32;
+  static const int LAST_CHAR = 126;
+private:
+  GLuint textureID;
+  Glyph glyphs[LAST_CHAR - FIRST_CHAR + 1];
+};
 
-class FTGLFont{
+/* A line of text laid out once into a vertex buffer of glyph quads, and
+   laid out again only when setText is given a different string. */
+class TextLabel{
 public:
-	FTGLFont(GLMatrices *mtx, float* color, char* fontfile, char *word, float size, float x, float y, float z, float scaleFactor);
-	~FTGLFont();
+	TextLabel(GLMatrices *mtx, GlyphAtlas *atlas, float* color, float x, float y, float z, float scaleFactor);
+	~TextLabel();
 	void draw();
-	void setWord(char* word);
+	void setText(const char* text);
+	static const int MAX_LENGTH = 99;
 private:
+	void layout();
 	GLMatrices *mtx;
-	FTFont* font;
-	GLuint fontMatrixID;
-	GLuint fontColorID;
+	GlyphAtlas *atlas;
+	GLuint VertexArrayID;
+	GLuint VertexBuffer;
+	int capacity; // characters the vertex buffer can hold
+	int numVertices;
+	vector<GLfloat> vertices;
+	GLint fontMatrixID;
+	GLint fontColorID;
 	float scaleFactor;
 	float x;
 	float y;
 	float z;
   	glm::vec3 fontColor; 
-  	char* fontfile;
-  	char* word;
+  	char text[MAX_LENGTH + 1];
+};
+
+/* Reference to an entity of the EntityStore. The generation tells a live
+   entity from one that was destroyed and whose slot was reused. */
+struct EntityHandle {
+  uint32_t index; // slot, stable for the entity's life
+  uint32_t generation;
+};
+
+enum EntityFlag {
+  ENTITY_VISIBLE = 1 << 0,   // part of the level (tiles: not a hole)
+  ENTITY_SLIDING = 1 << 1,
+  ENTITY_EMPTY = 1 << 2,     // nothing to stand on
+  ENTITY_SHOWN = 1 << 3,     // its entity wants it drawn (villain blink, bonus not taken, bullet in flight)
+  ENTITY_ALIVE = 1 << 4,
+  ENTITY_PATROLS = 1 << 5,   // villain walking back and forth
+  ENTITY_VILLAIN = 1 << 6,
+  ENTITY_BONUS = 1 << 7,
+  ENTITY_PROJECTILE = 1 << 8,
+  ENTITY_DYNAMIC = 1 << 9    // in the sweep and prune, see EntityStore::setDynamic
+};
+
+/* Collision broadphase: a uniform grid over x and z with one cell per tile,
+   hashed into a fixed table of buckets so the level can grow without
+   resizing it. Holds entity slots. An entity is linked into every cell its
+   box touches, edges included, since touching boxes count as colliding. */
+class SpatialHash{
+public:
+  SpatialHash();
+  void insert(uint32_t slot, float minX, float minZ, float maxX, float maxZ);
+  void remove(uint32_t slot);
+  bool move(uint32_t slot, float minX, float minZ, float maxX, float maxZ); // relinks only if the cells changed
+  void query(float minX, float minZ, float maxX, float maxZ, vector<uint32_t> &slots);
+private:
+  struct CellRange {
+    int minX, minZ, maxX, maxZ;
+    bool linked;
+  };
+  CellRange cellsOf(float minX, float minZ, float maxX, float maxZ);
+  int bucketOf(int cellX, int cellZ);
+  void link(uint32_t slot);
+  void unlink(uint32_t slot);
+  vector< vector<uint32_t> > buckets;
+  vector<CellRange> ranges; // by slot
+  vector<uint32_t> marks;   // by slot, so an entity in several cells is reported once
+  uint32_t mark;
+  static const int BUCKETS = 4096; // power of two
+};
+
+class EntityStore;
+
+struct EntityPair {
+  int a, b; // dense indices
+};
+
+/* Sort and sweep broadphase for the entities that move. Their x or z
+   intervals, whichever axis they are spread along most, are kept sorted by
+   insertion sort: they move little between ticks, so the sort is close to
+   linear. Sweeping the sorted list then only compares intervals that
+   overlap. Holds entity slots. */
+class SweepAndPrune{
+public:
+  SweepAndPrune();
+  void insert(uint32_t slot);
+  void remove(uint32_t slot);
+  void sweep(EntityStore &store, vector<EntityPair> &pairs);
+  struct Interval {
+    float lo, hi;
+    uint32_t slot;
+  };
+private:
+  void chooseAxis(EntityStore &store);
+  vector<Interval> intervals;
+  int axis; // 0 sorts on x, 2 on z
+};
+
+/* Boxes packed one array per bound for the batched overlap kernels. The
+   arrays are padded to a multiple of 8 with boxes that overlap nothing. */
+struct AabbBatch {
+  vector<float> minX, minY, minZ, maxX, maxY, maxZ;
+  vector<int> entity; // dense index of each box
+  int count;
+  AabbBatch();
+  void clear();
+  void add(int entity, float minX, float minY, float minZ, float maxX, float maxY, float maxZ);
+  void pad();
+};
+
+/* Tests box (minX, minY, minZ, maxX, maxY, maxZ) against every box of the
+   batch, bit i of mask is set when box i overlaps. Edges touching count. */
+typedef void (*OverlapKernel)(const float *box, const AabbBatch &batch, uint32_t *mask);
+
+/* Simulation state of every cuboid in the game, one array per component so
+   the per-tick loops stream through contiguous memory instead of chasing
+   Cuboid and entity pointers. Arrays are indexed by dense index and kept
+   packed: destroying an entity moves the last one into its place, so dense
+   indices change, handles and slots do not. Simulation side only. */
+class EntityStore{
+public:
+  EntityHandle create(float x, float y, float z, float width, float height, float length);
+  void destroy(EntityHandle handle);
+  bool isValid(EntityHandle handle);
+  int dense(EntityHandle handle); // handle must be valid
+  int size();
+  int getSlotCount();
+  bool overlaps(int a, int b);
+  void updateGrid();
+  void query(int entity, vector<int> &result);
+  void collide(int entity, const vector<int> &candidates, uint32_t flags, vector<int> &hits);
+  void collide(const float *box, const vector<int> &candidates, uint32_t flags, vector<int> &hits, int except = -1);
+  void queryBox(const float *box, vector<int> &result);
+  void boundsOf(int entity, float *box);
+  void setDynamic(int entity);
+  void sweep();
+  void pairedWith(int entity, vector<int> &result);
+  vector<float> x, y, z;
+  vector<float> halfX, halfY, halfZ; // extents
+  vector<float> angle;               // degrees about Y
+  vector<float> velX, velZ;          // units per second
+  vector<float> blinkTime, turnTime; // seconds since the last blink and turn
+  vector<uint32_t> flags;            // EntityFlag
+  vector<uint32_t> slotOf;           // dense index to slot
+private:
+  struct Slot {
+    uint32_t generation;
+    int dense; // -1 while free
+  };
+  void move(int from, int to);
+  void pop();
+  vector<Slot> slots;
+  vector<uint32_t> freeSlots;
+  SpatialHash grid;
+  vector<uint32_t> found;
+  AabbBatch batch;
+  vector<uint32_t> mask;
+  SweepAndPrune sweepAndPrune;
+  vector<EntityPair> pairs; // dynamic pairs of the last sweep()
+  friend class SweepAndPrune;
+};
+
+/* What rendering needs of a cuboid, copied out of the simulation each tick */
+struct CuboidState {
+  float x, y, z;
+  float angle;
+  bool visible;
+  bool sliding;
+  bool drawn; // its entity wants it drawn (alive, not picked up, ...)
 };
 
 class Cuboid{
 public:
 	Cuboid(GLMatrices *mtx, GLuint textureID, float *color, float x, float y, float z, float length, float width, float height, int type);
   ~Cuboid();
-  void draw();
+  void draw(int objectIndex);
+  void submit();
   void setPosition(float x, float y, float z);
   void setX(float value);
   void setY(float value);
@@ -104,6 +333,13 @@ public:
   float getLength();
   float getHeight();
   float getAngle();
+  GLuint getTextureID();
+  glm::mat4 getModelMatrix();
+  glm::vec3 getRenderPosition(float alpha);
+  glm::mat4 getRenderModelMatrix(float alpha);
+  AABB getRenderBounds(float alpha);
+  int getId();
+  AABB getBounds();
   void setAngle(float angle);
   void setVisible(bool value);
   void setEmpty(bool value);
@@ -114,40 +350,336 @@ public:
   bool isEmpty();
   bool checkCollision(Cuboid &cb);
   //friend bool checkCollisionMovingTile(Cuboid &cbd);
+  int getEntity();
   friend void undergoSliding();
+  friend class InstancedBatch;
+  friend class BoardMesh;
 private:
-  GLfloat *vertex_buffer_data;
-  GLfloat *color_buffer_data;
-  GLfloat *texture_buffer_data;
+  // Simulation state lives in the entity store, the rest is cold render data
+  EntityHandle handle;
   GLuint textureID;
   GLMatrices *mtx;
   VAO *vaobj;
   float initX;
   float initY;
   float initZ;
-  float x;
-  float y;
-  float z;
-  float length;
+  AABB boundsAt(const glm::vec3 &centre, float angle);
+  float length; // copies of the store's extents, for the render side
   float width;
   float height;
-  bool empty;
-  bool visible;
-  bool sliding;
+  int type;
   glm::vec3 axis;
-  float angle;
   static const float UPPER_LIMIT = 15.0f;
   static const float LOWER_LIMIT = -20.0f;
 };
 
+/* Draws every Cuboid sharing a cached mesh and texture with a single instanced call.
+   Per-instance data is (x, y, z, visible), so members must not be rotated. */
+class InstancedBatch{
+public:
+  InstancedBatch(GLMatrices *mtx, Cuboid *prototype);
+  ~InstancedBatch();
+  bool accepts(Cuboid &cbd);
+  void add(Cuboid *cbd);
+  void submit();
+  void draw();
+private:
+  void updateInstances();
+  GLMatrices *mtx;
+  GLuint textureID;
+  VAO *mesh;
+  GLuint VertexArrayID;
+  GLuint InstanceBuffer;
+  int capacity;
+  vector<Cuboid*> members;
+  vector<GLfloat> instance_buffer_data;
+};
+
+/* The board tiles that do not slide, meshed as a grid rather than as
+   cuboids: only faces that can be seen are emitted, and neighbouring faces
+   in one plane with one texture are merged into a single quad. Bottoms
+   are never seen, nor are the outer sides, which are under the water.
+   The grid is split into chunks of CHUNK x CHUNK tiles, each its own
+   buffer culled on its own, and only chunks whose tiles (or neighbours)
+   changed are meshed again. */
+class BoardMesh{
+public:
+  BoardMesh(GLMatrices *mtx, const vector<Cuboid*> &tiles);
+  ~BoardMesh();
+  void submit();
+  void drawChunk(int index);
+  void drawAll();
+  static const int CHUNK = 5;
+private:
+  // Indices of one texture within a chunk's buffer
+  struct Range {
+    GLuint textureID;
+    GLsizei first;
+    GLsizei count;
+  };
+  struct Chunk {
+    VAO *vao; // NULL when nothing in it shows
+    vector<Range> ranges;
+    AABB bounds;
+    bool dirty;
+  };
+  bool isSolid(int row, int col);
+  bool merges(int row, int col, Cuboid *tile);
+  void refresh();
+  void update();
+  void mesh(int index);
+  void addQuad(GLuint textureID, const glm::vec3 corners[4], bool textured);
+  GLMatrices *mtx;
+  vector<Cuboid*> tiles; // NUM_TILES_ROW x NUM_TILES_COL, row major
+  vector<char> solid;    // as last meshed
+  vector<Chunk> chunks;
+  int chunkRows;
+  int chunkCols;
+  int builtVersion;
+  map<GLuint, vector<GLfloat> > vertices; // scratch of mesh(), by texture
+  map<GLuint, vector<GLfloat> > uvs;
+};
+
+/* The water around the board: one grid of TILE_WIDTH x TILE_LENGTH cells at
+   the height of the tile tops, drawn in one call. Water.vert scrolls the
+   texture coordinates and Water.frag fades between the two textures. */
+class WaterPlane{
+public:
+  WaterPlane(GLMatrices *mtx, GLuint textureID1, GLuint textureID2);
+  ~WaterPlane();
+  void submit();
+  void draw();
+private:
+  GLMatrices *mtx;
+  GLuint textureID1;
+  GLuint textureID2;
+  VAO *vao;
+  AABB bounds;
+};
+
+/* What the tower and top cameras see of the board never changes, so it is
+   drawn once into color and depth textures, and every frame starts by
+   copying them to the screen. Drawn again when the camera, the size of
+   the framebuffer or the static geometry changes. */
+class BackgroundCache{
+public:
+  BackgroundCache();
+  void resize(int width, int height);
+  bool prepare();
+  void composite(int view, int staticVersion);
+private:
+  void create();
+  void destroy();
+  GLuint framebuffer;
+  GLuint colorTexture;
+  GLuint depthTexture;
+  GLuint emptyVertexArray; // the fullscreen triangle needs no buffers, but core GL wants a VAO
+  int width;
+  int height;
+  int cachedView;    // -1 when the textures are stale
+  int cachedVersion;
+  bool unsupported;  // the framebuffer was incomplete, never try again
+};
+
+enum RenderKind {
+  RENDER_CUBOID,
+  RENDER_INSTANCED_BATCH,
+  RENDER_BOARD_CHUNK,
+  RENDER_WATER,
+  RENDER_FONT
+};
+
+/* Render passes, the most significant part of the sort key */
+const int PASS_SCENE = 0;   // level geometry
+const int PASS_OBJECTS = 1; // player, bullet, villains, bonuses, win block
+const int PASS_HUD = 2;
+const int RENDER_PASSES = 3;
+
+struct RenderItem {
+  uint64_t key;
+  GLuint program;
+  RenderKind kind;
+  void *object;
+  int index;
+};
+
+/* Per frame list of draws, radix sorted on a key of
+   pass(4) | program(8) | texture(16) | mesh(12) | depth(24) bits so that
+   state changes are grouped and opaque cuboids go front to back. */
+class RenderQueue{
+public:
+  void clear();
+  void submit(uint64_t key, GLuint program, RenderKind kind, void *object, int index = 0);
+  void sort();
+  void flush();
+private:
+  vector<RenderItem> items;
+  vector<RenderItem> scratch;
+};
+
+uint64_t makeRenderKey(int pass, GLuint program, GLuint texture, GLuint mesh, float depth);
+
+/* CPU phases of a frame timed by the profiler */
+enum ProfileScope {
+  SCOPE_FRAME,  // start of one frame to the start of the next
+  SCOPE_UPDATE,
+  SCOPE_SUBMIT,
+  SCOPE_SORT,
+  SCOPE_FLUSH,
+  PROFILE_SCOPES
+};
+
+struct ProfileSample {
+  int frame;
+  double cpu[PROFILE_SCOPES];  // ms
+  double gpu[RENDER_PASSES];   // ms, meaningful once gpuValid
+  bool gpuValid;
+};
+
+/* GPU time of each render pass from GL_TIME_ELAPSED queries, read back
+   LATENCY frames later so the CPU never waits on them, plus CPU time of
+   the phases of a frame. Keeps the last HISTORY frames for dumping. */
+class FrameProfiler{
+public:
+  FrameProfiler();
+  void init();
+  void beginFrame();
+  void beginScope(ProfileScope scope);
+  void endScope(ProfileScope scope);
+  void addScopeTime(ProfileScope scope, double ms);
+  void beginPass(int pass);
+  void endPass();
+  void createOverlay(GlyphAtlas *atlas);
+  void toggleOverlay();
+  void submitOverlay();
+  bool dump(const char *filename);
+  static const int LATENCY = 4;
+  static const int HISTORY = 4096;
+  static const int OVERLAY_LINES = 4;
+private:
+  void collect(int slot);
+  void updateOverlay();
+  ProfileSample& sample(int frame);
+  GLuint queries[LATENCY][RENDER_PASSES];
+  bool issued[LATENCY][RENDER_PASSES];
+  int slotFrame[LATENCY]; // frame whose queries a slot holds, -1 if none
+  int activePass;
+  int frame;
+  double frameStart;
+  double scopeStart[PROFILE_SCOPES];
+  vector<ProfileSample> history;
+  int dropped; // GPU samples still unavailable after LATENCY frames
+  bool initialized;
+  bool overlayVisible;
+  TextLabel *overlay[OVERLAY_LINES];
+};
+
+/* Everything the renderer reads of one simulation tick. The simulation
+   fills one and publishes it; from then on nobody writes it. */
+struct WorldSnapshot {
+  double time;       // when it was published
+  double tickLength; // seconds between snapshots
+  double updateMs;   // CPU time spent in ticks so far, all of them
+  double simTime;    // seconds simulated so far
+  vector<CuboidState> previous; // at the start of the tick, by Cuboid id
+  vector<CuboidState> current;  // at its end
+  glm::vec3 headOffset;         // player's head relative to its body
+  char lastKey;
+  int score;
+  bool won;
+  bool lost;
+  int staticVersion;
+};
+
+/* Triple buffer of snapshots between the simulation and the renderer:
+   the simulation always has a buffer to write, the renderer always has a
+   complete one to read, and neither waits for the other. */
+class SnapshotBuffer{
+public:
+  SnapshotBuffer();
+  WorldSnapshot& back();
+  void publish();
+  const WorldSnapshot* acquire();
+private:
+  WorldSnapshot buffers[3];
+  int backIndex;  // simulation writes here
+  int readyIndex; // latest published
+  int frontIndex; // renderer reads here
+  bool fresh;     // ready holds a snapshot the renderer has not taken yet
+  pthread_mutex_t mutex;
+};
+
+/* Game input from the window callbacks. Only the simulation writes game
+   state, so it is queued and applied at the start of the next tick. */
+struct GameInput {
+  int key; // GLFW key, or INPUT_FIRE
+  int action;
+};
+
+const int INPUT_FIRE = -1;
+
+/* Runs the simulation at a fixed rate on its own thread, publishing a
+   snapshot after every tick, so rendering never waits for it. */
+class SimThread{
+public:
+  SimThread();
+  void start(double tickRate, int maxSteps);
+  void stop();
+  bool isRunning();
+private:
+  static void* threadMain(void *arg);
+  void run();
+  pthread_t thread;
+  pthread_mutex_t mutex;
+  bool running;       // render side
+  bool stopRequested; // under mutex
+  double tickLength;
+  int maxSteps;
+  long ticks;
+  long droppedTicks; // given up to the catch-up cap
+};
+
+/* Model matrices of the frame, read by TextureRender.vert through a buffer
+   texture at objectIndex. Three regions are cycled and fenced so the CPU
+   never writes what the GPU may still read; with ARB_buffer_storage they
+   stay persistently mapped, otherwise each is mapped unsynchronized per frame.
+   Slot 0 always holds the identity, for geometry already in world space. */
+class TransformBuffer{
+public:
+  TransformBuffer();
+  void create(int capacity);
+  void destroy();
+  void beginFrame();
+  int push(const glm::mat4 &model);
+  void endFrame();
+  void fenceFrame();
+  void bind();
+  int getCount();
+  static const int REGIONS = 3;
+  static const GLuint TEXTURE_UNIT = 1;
+private:
+  void waitRegion(int index);
+  GLuint buffers[REGIONS];
+  GLuint textures[REGIONS];
+  GLsync fences[REGIONS];
+  GLfloat *persistent[REGIONS];
+  GLfloat *mapped;
+  int capacity; // matrices per region
+  int region;
+  int count;
+  int peak; // pushes asked for this frame, including refused ones
+  int maxCapacity;
+};
+
 class Player{
 public:
   Player(GLMatrices *mtx, float x, float y, float z);
+  ~Player();
   void setPosition(float x, float y, float z);
   void setX(float value);
   void setY(float value);
   void setZ(float value);
-  void draw();
+  void submit();
   void applyForces();
   void setDynamic(bool value);
   void jump();
@@ -165,6 +697,7 @@ public:
   void decrementLife();
   void setLastKey(char value);
   int getStandingTileIndex();
+  bool sweptOntoTile(float fromY, Cuboid *tile);
   float getAngle();
   float getPosX();
   float getPosY();
@@ -172,19 +705,17 @@ public:
   float getHeadX();
   float getHeadY();
   float getHeadZ();
+  glm::vec3 getRenderPosition(float alpha);
   char getLastKey();
   float getHeight();
   float getWidth();
   float getLength();
-  friend bool checkCollisionVillain(Villain &v);
   friend void simulateCollisionVillain();
   friend void handleCollisionVillain();
 
-  friend bool checkCollisionBonus(Bonus &b);
-  friend void simulateCollisionBonus();
   friend void handleCollisionBonus();
+  friend void handleCollisionBullet();
 
-  friend bool checkCollisionMovingTile(Cuboid &cbd);
   friend void simulateCollisionMovingTile();
   friend void handleCollisionMovingTile();
 
@@ -218,67 +749,71 @@ private:
 class Villain{
 public:
   Villain(GLMatrices *mtx, float x, float y, float z, bool dynamic = false);
-  void draw();
+  ~Villain();
+  void submit();
   float getPosX();
   float getPosY();
   float getPosZ();
-  void applyForces(float timeInstance);
   bool getVisible();
   void setAlive(bool value);
   bool getAlive();
-  friend bool checkCollisionVillain(Villain &v);
-  friend void simulateCollisionVillain();
-  friend void handleCollisionVillain();
-
-  friend void handleCollisionBullet();
 private:
-  Cuboid *cb;
-  bool visible;
-  bool dynamic;
-  bool alive;
-  float time;
-  float speed;
-  float switchTime;
+  Cuboid *cb; // visibility, life, speed and timers are in the entity store
 };
 
 class Bonus{
 public:
   Bonus(GLMatrices *mtx, float x, float y, float z);
-  void draw();
+  ~Bonus();
+  void submit();
   float getPosX();
   float getPosY();
   float getPosZ();
   bool isVisible();
   void setVisible(bool value);
-  friend bool checkCollisionBonus(Bonus &b);
-  friend void simulateCollisionBonus();
-  friend void handleCollisionBonus();
 private:
-  Cuboid *cb;
-  bool visible;
+  Cuboid *cb; // taken or not is in the entity store
 };
 
 class Bullet{
 public:
   Bullet(GLMatrices *mtx, float x, float y, float z, float ux, float uz);
+  ~Bullet();
   void applyForces(float timeInstance);
-  void draw();
+  void submit();
   void fire();
-
   friend void handleCollisionBullet();
 private:
-  Cuboid *cb;
-  float ux;
-  float uz;
-  bool visible;
+  Cuboid *cb; // in flight and velocity are in the entity store
   float speed;
+  bool inFlight;   // at the start of the tick
+  glm::vec3 from;  // centre at the start of the tick
 };
 
 Cuboid *cb;
 Cuboid *winBlock;
+EntityStore entities;
+vector<CuboidState> simPrevious; // simulation side, states at the start of the tick, by entity slot
+SnapshotBuffer snapshots;
+const WorldSnapshot *frontSnapshot = NULL; // render side, the snapshot being drawn
+vector<GameInput> pendingInput;
+pthread_mutex_t inputMutex = PTHREAD_MUTEX_INITIALIZER;
+SimThread simThread;
+float renderAlpha = 1.0f; // how far rendering is from the previous simulation state to the current one
+const float TELEPORT_DISTANCE = 5.0f;
 Player *p;
 vector<Cuboid*> tilesList;
-vector<Cuboid*> waterList;
+WaterPlane *waterPlane;
+BackgroundCache backgroundCache;
+bool backgroundCacheEnabled = true;
+vector<InstancedBatch*> sceneBatches;
+BoardMesh *boardMesh;
+Frustum viewFrustum;
+CullStats cullStats;
+RenderQueue renderQueue;
+TransformBuffer objectTransforms;
+FrameProfiler profiler;
+const char *profileDumpFile = NULL; // --profile, written on exit
 vector<Villain*> villainList;
 vector<Bonus*> bonusList;
 int viewMode;
@@ -294,74 +829,304 @@ bool looseFlag;
 bool winFlag;
 int lives;
 Bullet *bt;
-FTGLFont *f1;
+GlyphAtlas *hudFont;
+TextLabel *scoreLabel;
 int score;
 sf::SoundBuffer bonusBuffer;
 sf::SoundBuffer villainBuffer;
 sf::Sound sound;
 
+/* Seconds on a monotonic clock, usable from any thread and without a window */
+double currentTime()
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec + now.tv_nsec * 1e-9;
+}
+
+/* Read only view of assets.pack. The mapping stays alive for the whole run,
+   so payloads are handed out as pointers into it and never copied. When
+   the pack or an entry is missing, callers fall back to the loose file. */
+class AssetPack{
+public:
+  AssetPack();
+  bool open(const char *path);
+  void close();
+  const PackEntry* find(const char *name, PackAssetType type);
+  const void* data(const PackEntry *entry);
+private:
+  void *base;
+  size_t length;
+  const PackHeader *header;
+  const PackEntry *entries;
+};
+
+AssetPack::AssetPack(){
+  base = NULL;
+  length = 0;
+  header = NULL;
+  entries = NULL;
+}
+
+bool AssetPack::open(const char *path){
+  int fd = ::open(path, O_RDONLY);
+  if(fd < 0)return false;
+  struct stat info;
+  if(fstat(fd, &info) != 0 || info.st_size < (off_t)sizeof(PackHeader)){
+    ::close(fd);
+    return false;
+  }
+  length = info.st_size;
+  base = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0);
+  ::close(fd); // the mapping keeps the file referenced
+  if(base == MAP_FAILED){
+    base = NULL;
+    return false;
+  }
+  header = (const PackHeader*)base;
+  entries = (const PackEntry*)(header + 1);
+  if(header->magic != PACK_MAGIC || header->version != PACK_VERSION ||
+     sizeof(PackHeader) + header->entryCount * sizeof(PackEntry) > length){
+    cout << "Ignoring " << path << ": not a pack of version " << PACK_VERSION << endl;
+    close();
+    return false;
+  }
+  for(uint32_t i = 0; i < header->entryCount; i++){
+    if(entries[i].offset + entries[i].size > length){
+      cout << "Ignoring " << path << ": truncated" << endl;
+      close();
+      return false;
+    }
+  }
+  cout << "Using " << path << " (" << header->entryCount << " assets)" << endl;
+  return true;
+}
+
+void AssetPack::close(){
+  if(base != NULL)
+    munmap(base, length);
+  base = NULL;
+  length = 0;
+  header = NULL;
+  entries = NULL;
+}
+
+/* The pack holds a few dozen entries, a linear scan is enough */
+const PackEntry* AssetPack::find(const char *name, PackAssetType type){
+  if(header == NULL)return NULL;
+  for(uint32_t i = 0; i < header->entryCount; i++){
+    if(entries[i].type == (uint32_t)type && strncmp(entries[i].name, name, PACK_NAME_LENGTH) == 0)
+      return &entries[i];
+  }
+  return NULL;
+}
+
+const void* AssetPack::data(const PackEntry *entry){
+  return (const char*)base + entry->offset;
+}
+
+AssetPack assetPack;
+
+/* Shader source from the pack, or read from the loose file into storage */
+void shaderSource(const char *path, std::string &storage, const char *&source, GLint &length)
+{
+  const PackEntry *entry = assetPack.find(path, PACK_SHADER);
+  if(entry != NULL){
+    source = (const char*)assetPack.data(entry);
+    length = entry->size;
+    return;
+  }
+  std::ifstream stream(path, std::ios::in);
+  if(stream.is_open())
+  {
+    std::string Line = "";
+    while(getline(stream, Line))
+      storage += "\n" + Line;
+    stream.close();
+  }
+  source = storage.c_str();
+  length = storage.size();
+}
+
+/* Sound from the pack, decoded from memory, or from the loose file */
+bool loadSound(sf::SoundBuffer &buffer, const char *path)
+{
+  const PackEntry *entry = assetPack.find(path, PACK_AUDIO);
+  if(entry != NULL)
+    return buffer.loadFromMemory(assetPack.data(entry), entry->size);
+  return buffer.loadFromFile(path);
+}
+
+/* Linked programs are cached on disk with glGetProgramBinary, one file per
+   program named after a hash of both sources and the driver strings, so an
+   edited shader or a driver update simply misses the cache. */
+const char *PROGRAM_CACHE_DIR = "shader_cache";
+const uint32_t PROGRAM_CACHE_MAGIC = 0x50434c41; // "ALCP"
+
+struct ProgramCacheHeader {
+  uint32_t magic;
+  uint32_t format;
+  uint64_t key;
+  uint32_t length;
+  uint32_t reserved;
+};
+
+uint64_t fnv1a(uint64_t hash, const void *data, size_t length)
+{
+  const unsigned char *bytes = (const unsigned char*)data;
+  for(size_t i = 0; i < length; i++){
+    hash ^= bytes[i];
+    hash *= 1099511628211ULL;
+  }
+  return hash;
+}
+
+uint64_t programCacheKey(const char *vertexSource, GLint vertexLength, const char *fragmentSource, GLint fragmentLength)
+{
+  uint64_t hash = 14695981039346656037ULL;
+  hash = fnv1a(hash, vertexSource, vertexLength);
+  hash = fnv1a(hash, "", 1); // keep the boundary between the sources
+  hash = fnv1a(hash, fragmentSource, fragmentLength);
+  GLenum strings[3] = {GL_VENDOR, GL_RENDERER, GL_VERSION};
+  for(int i = 0; i < 3; i++){
+    const char *value = (const char*)glGetString(strings[i]);
+    if(value != NULL)
+      hash = fnv1a(hash, value, strlen(value) + 1);
+  }
+  return hash;
+}
+
+bool programCacheAvailable()
+{
+  if(!GLAD_GL_ARB_get_program_binary)return false;
+  GLint formats = 0;
+  glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &formats);
+  return formats > 0;
+}
+
+string programCachePath(uint64_t key)
+{
+  char name[64];
+  sprintf(name, "%s/%016llx.bin", PROGRAM_CACHE_DIR, (unsigned long long)key);
+  return name;
+}
+
+/* Returns a linked program, or 0 when there is no usable cache entry */
+GLuint loadProgramBinary(uint64_t key)
+{
+  if(!programCacheAvailable())return 0;
+  std::ifstream in(programCachePath(key).c_str(), std::ios::in | std::ios::binary);
+  if(!in.is_open())return 0;
+  ProgramCacheHeader header;
+  in.read((char*)&header, sizeof(header));
+  if(!in.good() || header.magic != PROGRAM_CACHE_MAGIC || header.key != key || header.length == 0)return 0;
+  std::vector<char> binary(header.length);
+  in.read(&binary[0], header.length);
+  if(!in.good())return 0;
+
+  GLuint ProgramID = glCreateProgram();
+  glProgramBinary(ProgramID, header.format, &binary[0], header.length);
+  GLint Result = GL_FALSE;
+  glGetProgramiv(ProgramID, GL_LINK_STATUS, &Result);
+  if(Result != GL_TRUE){
+    // The driver may reject its own binaries, e.g. after an update
+    glDeleteProgram(ProgramID);
+    return 0;
+  }
+  return ProgramID;
+}
+
+void saveProgramBinary(GLuint ProgramID, uint64_t key)
+{
+  if(!programCacheAvailable())return;
+  GLint length = 0;
+  glGetProgramiv(ProgramID, GL_PROGRAM_BINARY_LENGTH, &length);
+  if(length <= 0)return;
+  std::vector<char> binary(length);
+  GLenum format;
+  glGetProgramBinary(ProgramID, length, NULL, &format, &binary[0]);
+
+  mkdir(PROGRAM_CACHE_DIR, 0755);
+  std::ofstream out(programCachePath(key).c_str(), std::ios::out | std::ios::binary | std::ios::trunc);
+  if(!out.is_open())return;
+  ProgramCacheHeader header;
+  header.magic = PROGRAM_CACHE_MAGIC;
+  header.format = format;
+  header.key = key;
+  header.length = length;
+  header.reserved = 0;
+  out.write((const char*)&header, sizeof(header));
+  out.write(&binary[0], length);
+}
+
+/* Print a shader or program info log, drivers often return an empty one */
+void printInfoLog(const std::vector<char> &log)
+{
+  if(log.size() > 1 && log[0] != '\0')
+    fprintf(stdout, "%s\n", &log[0]);
+}
+
 /* Function to load Shaders - Use it as it is */
 GLuint LoadShaders(const char * vertex_file_path,const char * fragment_file_path) {
 
-	// Create the shaders
-	GLuint VertexShaderID = glCreateShader(GL_VERTEX_SHADER);
-	GLuint FragmentShaderID = glCreateShader(GL_FRAGMENT_SHADER);
-
-	// Read the Vertex Shader code from the file
+	// Read the Vertex Shader code from the pack or the file
 	std::string VertexShaderCode;
-	std::ifstream VertexShaderStream(vertex_file_path, std::ios::in);
-	if(VertexShaderStream.is_open())
-	{
-		std::string Line = "";
-		while(getline(VertexShaderStream, Line))
-			VertexShaderCode += "\n" + Line;
-		VertexShaderStream.close();
-	}
+	char const * VertexSourcePointer;
+	GLint VertexSourceLength;
+	shaderSource(vertex_file_path, VertexShaderCode, VertexSourcePointer, VertexSourceLength);
 
-	// Read the Fragment Shader code from the file
+	// Read the Fragment Shader code from the pack or the file
 	std::string FragmentShaderCode;
-	std::ifstream FragmentShaderStream(fragment_file_path, std::ios::in);
-	if(FragmentShaderStream.is_open()){
-		std::string Line = "";
-		while(getline(FragmentShaderStream, Line))
-			FragmentShaderCode += "\n" + Line;
-		FragmentShaderStream.close();
+	char const * FragmentSourcePointer;
+	GLint FragmentSourceLength;
+	shaderSource(fragment_file_path, FragmentShaderCode, FragmentSourcePointer, FragmentSourceLength);
+
+	// Reuse the program linked by an earlier run when nothing changed
+	uint64_t CacheKey = programCacheKey(VertexSourcePointer, VertexSourceLength, FragmentSourcePointer, FragmentSourceLength);
+	GLuint CachedProgramID = loadProgramBinary(CacheKey);
+	if(CachedProgramID != 0){
+		printf("Loaded cached program : %s + %s\n", vertex_file_path, fragment_file_path);
+		return CachedProgramID;
 	}
 
+	// Create the shaders
+	GLuint VertexShaderID = glCreateShader(GL_VERTEX_SHADER);
+	GLuint FragmentShaderID = glCreateShader(GL_FRAGMENT_SHADER);
+
 	GLint Result = GL_FALSE;
 	int InfoLogLength;
 
 	// Compile Vertex Shader
 	printf("Compiling shader : %s\n", vertex_file_path);
-	char const * VertexSourcePointer = VertexShaderCode.c_str();
-	glShaderSource(VertexShaderID, 1, &VertexSourcePointer , NULL);
+	glShaderSource(VertexShaderID, 1, &VertexSourcePointer , &VertexSourceLength);
 	glCompileShader(VertexShaderID);
 
 	// Check Vertex Shader
 	glGetShaderiv(VertexShaderID, GL_COMPILE_STATUS, &Result);
 	glGetShaderiv(VertexShaderID, GL_INFO_LOG_LENGTH, &InfoLogLength);
-	std::vector<char> VertexShaderErrorMessage(InfoLogLength);
+	std::vector<char> VertexShaderErrorMessage( max(InfoLogLength, int(1)) );
 	glGetShaderInfoLog(VertexShaderID, InfoLogLength, NULL, &VertexShaderErrorMessage[0]);
-	fprintf(stdout, "%s\n", &VertexShaderErrorMessage[0]);
+	printInfoLog(VertexShaderErrorMessage);
 
 	// Compile Fragment Shader
 	printf("Compiling shader : %s\n", fragment_file_path);
-	char const * FragmentSourcePointer = FragmentShaderCode.c_str();
-	glShaderSource(FragmentShaderID, 1, &FragmentSourcePointer , NULL);
+	glShaderSource(FragmentShaderID, 1, &FragmentSourcePointer , &FragmentSourceLength);
 	glCompileShader(FragmentShaderID);
 
 	// Check Fragment Shader
 	glGetShaderiv(FragmentShaderID, GL_COMPILE_STATUS, &Result);
 	glGetShaderiv(FragmentShaderID, GL_INFO_LOG_LENGTH, &InfoLogLength);
-	std::vector<char> FragmentShaderErrorMessage(InfoLogLength);
+	std::vector<char> FragmentShaderErrorMessage( max(InfoLogLength, int(1)) );
 	glGetShaderInfoLog(FragmentShaderID, InfoLogLength, NULL, &FragmentShaderErrorMessage[0]);
-	fprintf(stdout, "%s\n", &FragmentShaderErrorMessage[0]);
+	printInfoLog(FragmentShaderErrorMessage);
 
 	// Link the program
 	fprintf(stdout, "Linking program\n");
 	GLuint ProgramID = glCreateProgram();
 	glAttachShader(ProgramID, VertexShaderID);
 	glAttachShader(ProgramID, FragmentShaderID);
+	if(programCacheAvailable())
+		glProgramParameteri(ProgramID, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
 	glLinkProgram(ProgramID);
 
 	// Check the program
@@ -369,11 +1134,14 @@ GLuint LoadShaders(const char * vertex_file_path,const char * fragment_file_path
 	glGetProgramiv(ProgramID, GL_INFO_LOG_LENGTH, &InfoLogLength);
 	std::vector<char> ProgramErrorMessage( max(InfoLogLength, int(1)) );
 	glGetProgramInfoLog(ProgramID, InfoLogLength, NULL, &ProgramErrorMessage[0]);
-	fprintf(stdout, "%s\n", &ProgramErrorMessage[0]);
+	printInfoLog(ProgramErrorMessage);
 
 	glDeleteShader(VertexShaderID);
 	glDeleteShader(FragmentShaderID);
 
+	if(Result == GL_TRUE)
+		saveProgramBinary(ProgramID, CacheKey);
+
 	return ProgramID;
 }
 
@@ -384,18 +1152,192 @@ static void error_callback(int error, const char* description)
 
 void quit(GLFWwindow *window)
 {
-    glfwDestroyWindow(window);
-    glfwTerminate();
+    // Nothing may touch the game state while it is torn down
+    simThread.stop();
+    if(profileDumpFile != NULL)
+        profiler.dump(profileDumpFile);
+    // Headless runs have no window and never initialized GLFW
+    if(window != NULL){
+        glfwDestroyWindow(window);
+        glfwTerminate();
+    }
     exit(EXIT_SUCCESS);
 }
 
 
+/* Shadow copy of the GL state touched by the draw path, calls that would not
+   change anything are skipped and counted. Every bind in the draw path
+   must go through these helpers, or invalidateGLState() must be called
+   after foreign code touched GL. */
+const int STATE_TEXTURE_UNITS = 4;
+
+struct GLStateCache {
+  GLuint program;
+  GLuint vertexArray;
+  GLuint activeUnit;
+  GLuint textures[STATE_TEXTURE_UNITS];
+  GLenum polygonMode;
+  bool valid;
+  map<pair<GLuint, string>, GLint> uniformLocations;
+  map<pair<GLuint, GLint>, GLint> uniformInts;
+  int issued;
+  int skipped;
+  int lastIssued;
+  int lastSkipped;
+};
+
+GLStateCache glState;
+
+void invalidateGLState()
+{
+  glState.valid = false;
+  glState.uniformInts.clear();
+}
+
+/* Roll the issued/skipped counters over, call once at the start of a frame */
+void beginGLStateFrame()
+{
+  glState.lastIssued = glState.issued;
+  glState.lastSkipped = glState.skipped;
+  glState.issued = glState.skipped = 0;
+}
+
+void stateRevalidate()
+{
+  if(glState.valid)return;
+  // Unknown state: make every shadow value impossible so the next call goes through
+  glState.program = (GLuint)-1;
+  glState.vertexArray = (GLuint)-1;
+  glState.activeUnit = (GLuint)-1;
+  for(int i = 0; i < STATE_TEXTURE_UNITS; i++)
+    glState.textures[i] = (GLuint)-1;
+  glState.polygonMode = GL_NONE;
+  glState.valid = true;
+}
+
+void stateUseProgram(GLuint program)
+{
+  stateRevalidate();
+  if(glState.program == program){
+    glState.skipped++;
+    return;
+  }
+  glUseProgram(program);
+  glState.program = program;
+  glState.issued++;
+}
+
+void stateBindVertexArray(GLuint vertexArray)
+{
+  stateRevalidate();
+  if(glState.vertexArray == vertexArray){
+    glState.skipped++;
+    return;
+  }
+  glBindVertexArray(vertexArray);
+  glState.vertexArray = vertexArray;
+  glState.issued++;
+}
+
+/* A unit is only ever used with one target, so the shadow is per unit */
+void stateBindTexture(GLuint unit, GLuint texture, GLenum target = GL_TEXTURE_2D)
+{
+  stateRevalidate();
+  if(glState.textures[unit] == texture){
+    glState.skipped++;
+    return;
+  }
+  if(glState.activeUnit != unit){
+    glActiveTexture(GL_TEXTURE0 + unit);
+    glState.activeUnit = unit;
+    glState.issued++;
+  }
+  glBindTexture(target, texture);
+  glState.textures[unit] = texture;
+  glState.issued++;
+}
+
+void statePolygonMode(GLenum mode)
+{
+  stateRevalidate();
+  if(glState.polygonMode == mode){
+    glState.skipped++;
+    return;
+  }
+  glPolygonMode(GL_FRONT_AND_BACK, mode);
+  glState.polygonMode = mode;
+  glState.issued++;
+}
+
+/* Looks a uniform up once per program and name */
+GLint stateUniformLocation(GLuint program, const char *name)
+{
+  pair<GLuint, string> key(program, name);
+  map<pair<GLuint, string>, GLint>::iterator it = glState.uniformLocations.find(key);
+  if(it != glState.uniformLocations.end()){
+    glState.skipped++;
+    return it->second;
+  }
+  GLint location = glGetUniformLocation(program, name);
+  glState.uniformLocations[key] = location;
+  glState.issued++;
+  return location;
+}
+
+/* Sets an int uniform (e.g. a sampler) on the current program if it differs */
+void stateUniform1i(const char *name, GLint value)
+{
+  stateRevalidate();
+  GLint location = stateUniformLocation(glState.program, name);
+  pair<GLuint, GLint> key(glState.program, location);
+  map<pair<GLuint, GLint>, GLint>::iterator it = glState.uniformInts.find(key);
+  if(it != glState.uniformInts.end() && it->second == value){
+    glState.skipped++;
+    return;
+  }
+  glUniform1i(location, value);
+  glState.uniformInts[key] = value;
+  glState.issued++;
+}
+
+/* Camera matrices shared by every program with a "Camera" uniform block,
+   uploaded once per frame rather than folded into a per draw MVP.
+   Layout follows the std140 block: projection, view, viewProjection. */
+const GLuint CAMERA_BINDING = 0;
+
+void createCameraBuffer(GLMatrices *mtx)
+{
+  glGenBuffers(1, &mtx->CameraBuffer);
+  glBindBuffer(GL_UNIFORM_BUFFER, mtx->CameraBuffer);
+  glBufferData(GL_UNIFORM_BUFFER, 3*sizeof(glm::mat4), NULL, GL_DYNAMIC_DRAW);
+  glBindBufferBase(GL_UNIFORM_BUFFER, CAMERA_BINDING, mtx->CameraBuffer);
+}
+
+void bindCameraBlock(GLuint program)
+{
+  GLuint block = glGetUniformBlockIndex(program, "Camera");
+  if(block != GL_INVALID_INDEX)
+    glUniformBlockBinding(program, block, CAMERA_BINDING);
+}
+
+void updateCameraBuffer(GLMatrices *mtx, const glm::mat4 &projection, const glm::mat4 &view)
+{
+  glm::mat4 camera[3];
+  camera[0] = projection;
+  camera[1] = view;
+  camera[2] = projection * view;
+  glBindBuffer(GL_UNIFORM_BUFFER, mtx->CameraBuffer);
+  glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(camera), &camera[0][0][0]);
+}
+
 /* Generate VAO, VBOs and return VAO handle */
 struct VAO* create3DObject (GLenum primitive_mode, int numVertices, const GLfloat* vertex_buffer_data, const GLfloat* color_buffer_data, GLenum fill_mode=GL_FILL)
 {
     struct VAO* vao = new struct VAO;
     vao->PrimitiveMode = primitive_mode;
     vao->NumVertices = numVertices;
+    vao->NumIndices = 0;
+    vao->IndexBuffer = 0;
     vao->FillMode = fill_mode;
 
     // Create Vertex Array Object
@@ -404,7 +1346,7 @@ struct VAO* create3DObject (GLenum primitive_mode, int numVertices, const GLfloa
     glGenBuffers (1, &(vao->VertexBuffer)); // VBO - vertices
     glGenBuffers (1, &(vao->ColorBuffer));  // VBO - colors
 
-    glBindVertexArray (vao->VertexArrayID); // Bind the VAO 
+    stateBindVertexArray (vao->VertexArrayID); // Bind the VAO 
     glBindBuffer (GL_ARRAY_BUFFER, vao->VertexBuffer); // Bind the VBO vertices 
     glBufferData (GL_ARRAY_BUFFER, 3*numVertices*sizeof(GLfloat), vertex_buffer_data, GL_STATIC_DRAW); // Copy the vertices into VBO
     glVertexAttribPointer(
@@ -415,6 +1357,7 @@ struct VAO* create3DObject (GLenum primitive_mode, int numVertices, const GLfloa
                           0,                  // stride
                           (void*)0            // array buffer offset
                           );
+    glEnableVertexAttribArray(0); // Enabled state is stored in the VAO
 
     glBindBuffer (GL_ARRAY_BUFFER, vao->ColorBuffer); // Bind the VBO colors 
     glBufferData (GL_ARRAY_BUFFER, 3*numVertices*sizeof(GLfloat), color_buffer_data, GL_STATIC_DRAW);  // Copy the vertex colors
@@ -426,6 +1369,7 @@ struct VAO* create3DObject (GLenum primitive_mode, int numVertices, const GLfloa
                           0,                  // stride
                           (void*)0            // array buffer offset
                           );
+    glEnableVertexAttribArray(1);
 
     return vao;
 }
@@ -447,20 +1391,10 @@ struct VAO* create3DObject (GLenum primitive_mode, int numVertices, const GLfloa
 void draw3DObject (struct VAO* vao)
 {
     // Change the Fill Mode for this object
-    glPolygonMode (GL_FRONT_AND_BACK, vao->FillMode);
-
-    // Bind the VAO to use
-    glBindVertexArray (vao->VertexArrayID);
+    statePolygonMode (vao->FillMode);
 
-    // Enable Vertex Attribute 0 - 3d Vertices
-    glEnableVertexAttribArray(0);
-    // Bind the VBO to use
-    glBindBuffer(GL_ARRAY_BUFFER, vao->VertexBuffer);
-
-    // Enable Vertex Attribute 1 - Color
-    glEnableVertexAttribArray(1);
-    // Bind the VBO to use
-    glBindBuffer(GL_ARRAY_BUFFER, vao->ColorBuffer);
+    // Bind the VAO to use, it already carries the enabled vertex/color attributes
+    stateBindVertexArray (vao->VertexArrayID);
 
     // Draw the geometry !
     glDrawArrays(vao->PrimitiveMode, 0, vao->NumVertices); // Starting from vertex 0; 3 vertices total -> 1 triangle
@@ -471,6 +1405,8 @@ struct VAO* create3DTexturedObject (GLenum primitive_mode, int numVertices, cons
   struct VAO* vao = new struct VAO;
   vao->PrimitiveMode = primitive_mode;
   vao->NumVertices = numVertices;
+  vao->NumIndices = 0;
+  vao->IndexBuffer = 0;
   vao->FillMode = fill_mode;
   vao->TextureID = textureID;
 
@@ -480,7 +1416,7 @@ struct VAO* create3DTexturedObject (GLenum primitive_mode, int numVertices, cons
   glGenBuffers (1, &(vao->VertexBuffer)); // VBO - vertices
   glGenBuffers (1, &(vao->TextureBuffer));  // VBO - textures
 
-  glBindVertexArray (vao->VertexArrayID); // Bind the VAO
+  stateBindVertexArray (vao->VertexArrayID); // Bind the VAO
   glBindBuffer (GL_ARRAY_BUFFER, vao->VertexBuffer); // Bind the VBO vertices
   glBufferData (GL_ARRAY_BUFFER, 3*numVertices*sizeof(GLfloat), vertex_buffer_data, GL_STATIC_DRAW); // Copy the vertices into VBO
   glVertexAttribPointer(
@@ -491,6 +1427,7 @@ struct VAO* create3DTexturedObject (GLenum primitive_mode, int numVertices, cons
               0,                  // stride
               (void*)0            // array buffer offset
               );
+  glEnableVertexAttribArray(0); // Enabled state is stored in the VAO
 
   glBindBuffer (GL_ARRAY_BUFFER, vao->TextureBuffer); // Bind the VBO textures
   glBufferData (GL_ARRAY_BUFFER, 2*numVertices*sizeof(GLfloat), texture_buffer_data, GL_STATIC_DRAW);  // Copy the vertex colors
@@ -502,46 +1439,59 @@ struct VAO* create3DTexturedObject (GLenum primitive_mode, int numVertices, cons
               0,                  // stride
               (void*)0            // array buffer offset
               );
+  glEnableVertexAttribArray(2);
 
   return vao;
 }
 
-void draw3DTexturedObject (struct VAO* vao)
+/* Same as above, plus an element buffer so shared corners are stored and transformed once */
+struct VAO* create3DTexturedObject (GLenum primitive_mode, int numVertices, const GLfloat* vertex_buffer_data, const GLfloat* texture_buffer_data, int numIndices, GLenum index_type, const void* index_buffer_data, GLuint textureID, GLenum fill_mode=GL_FILL)
 {
-  // Change the Fill Mode for this object
-  glPolygonMode (GL_FRONT_AND_BACK, vao->FillMode);
+  struct VAO* vao = create3DTexturedObject(primitive_mode, numVertices, vertex_buffer_data, texture_buffer_data, textureID, fill_mode);
+  vao->NumIndices = numIndices;
+  vao->IndexType = index_type;
+  int indexSize = (index_type == GL_UNSIGNED_INT) ? sizeof(GLuint) : sizeof(GLushort);
 
-  // Bind the VAO to use
-  glBindVertexArray (vao->VertexArrayID);
+  glGenBuffers (1, &(vao->IndexBuffer)); // EBO - indices
+  // The element buffer binding is part of the VAO, which is still bound here
+  glBindBuffer (GL_ELEMENT_ARRAY_BUFFER, vao->IndexBuffer);
+  glBufferData (GL_ELEMENT_ARRAY_BUFFER, numIndices*indexSize, index_buffer_data, GL_STATIC_DRAW);
 
-  // Enable Vertex Attribute 0 - 3d Vertices
-  glEnableVertexAttribArray(0);
-  // Bind the VBO to use
-  glBindBuffer(GL_ARRAY_BUFFER, vao->VertexBuffer);
+  return vao;
+}
 
-  // Bind Textures using texture units
-  glBindTexture(GL_TEXTURE_2D, vao->TextureID);
+void draw3DTexturedObject (struct VAO* vao, GLuint textureID)
+{
+  // Change the Fill Mode for this object
+  statePolygonMode (vao->FillMode);
 
-  // Enable Vertex Attribute 2 - Texture
-  glEnableVertexAttribArray(2);
-  // Bind the VBO to use
-  glBindBuffer(GL_ARRAY_BUFFER, vao->TextureBuffer);
+  // Bind the VAO to use, it already carries the enabled vertex/texture attributes
+  stateBindVertexArray (vao->VertexArrayID);
+
+  // Bind Textures using texture units
+  stateBindTexture(0, textureID);
 
   // Draw the geometry !
-  glDrawArrays(vao->PrimitiveMode, 0, vao->NumVertices); // Starting from vertex 0; 3 vertices total -> 1 triangle
+  if(vao->NumIndices > 0)
+    glDrawElements(vao->PrimitiveMode, vao->NumIndices, vao->IndexType, (void*)0);
+  else
+    glDrawArrays(vao->PrimitiveMode, 0, vao->NumVertices); // Starting from vertex 0; 3 vertices total -> 1 triangle
+}
 
-  // Unbind Textures to be safe
-  glBindTexture(GL_TEXTURE_2D, 0);
+void draw3DTexturedObject (struct VAO* vao)
+{
+  draw3DTexturedObject(vao, vao->TextureID);
 }
 
 /* Create an OpenGL Texture from an image */
-GLuint createTexture (const char* filename)
+/* Generate a texture with the game's sampling parameters, left bound to unit 0 */
+GLuint genTexture ()
 {
   GLuint TextureID;
   // Generate Texture Buffer
   glGenTextures(1, &TextureID);
   // All upcoming GL_TEXTURE_2D operations now have effect on our texture buffer
-  glBindTexture(GL_TEXTURE_2D, TextureID);
+  stateBindTexture(0, TextureID);
   // Set our texture parameters
   // Set texture wrapping to GL_REPEAT
   glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
@@ -549,566 +1499,2272 @@ GLuint createTexture (const char* filename)
   // Set texture filtering (interpolation)
   glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST_MIPMAP_NEAREST);
   glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+  return TextureID;
+}
+
+GLuint createTexture (const char* filename)
+{
+  GLuint TextureID = genTexture();
+
+  // Baked textures carry their mip chain, upload every level straight from the pack
+  const PackEntry *entry = assetPack.find(filename, PACK_TEXTURE);
+  if(entry != NULL){
+    const unsigned char *level = (const unsigned char*)assetPack.data(entry);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1); // RGB rows are tightly packed
+    for(uint32_t i = 0; i < entry->levels; i++){
+      GLsizei w = entry->width >> i, h = entry->height >> i;
+      glTexImage2D(GL_TEXTURE_2D, i, GL_RGB, w ? w : 1, h ? h : 1, 0, GL_RGB, GL_UNSIGNED_BYTE, level);
+      level += packLevelSize(entry->width, entry->height, i);
+    }
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, entry->levels - 1);
+    stateBindTexture(0, 0);
+    return TextureID;
+  }
 
   // Load image and create OpenGL texture
   int twidth, theight;
   unsigned char* image = SOIL_load_image(filename, &twidth, &theight, 0, SOIL_LOAD_RGB);
+  if(image == NULL){
+    // Callers report SOIL_last_result() when they get 0
+    stateBindTexture(0, 0);
+    glDeleteTextures(1, &TextureID);
+    return 0;
+  }
   glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, twidth, theight, 0, GL_RGB, GL_UNSIGNED_BYTE, image);
   glGenerateMipmap(GL_TEXTURE_2D); // Generate MipMaps to use
   SOIL_free_image_data(image); // Free the data read from file after creating opengl texture
-  glBindTexture(GL_TEXTURE_2D, 0); // Unbind texture when done, so we won't accidentily mess it up
+  stateBindTexture(0, 0); // Unbind texture when done, so we won't accidentily mess it up
 
   return TextureID;
 }
 
+struct CachedTexture {
+  GLuint TextureID;
+  int refCount;
+};
+
+map<string, CachedTexture> textureCache;
+
+/* Return the texture for an image file, decoding and uploading it only on first request.
+   Failed loads return 0 and are not cached, so the next request tries again. */
+GLuint acquireTexture (const char* filename)
+{
+  map<string, CachedTexture>::iterator it = textureCache.find(filename);
+  if(it == textureCache.end()){
+    CachedTexture tex;
+    tex.TextureID = createTexture(filename);
+    if(tex.TextureID == 0)return 0;
+    tex.refCount = 0;
+    it = textureCache.insert(make_pair(string(filename), tex)).first;
+  }
+  it->second.refCount++;
+  return it->second.TextureID;
+}
+
+/* Drop a reference, the GL texture is deleted once nobody uses it */
+void releaseTexture (GLuint textureID)
+{
+  map<string, CachedTexture>::iterator it;
+  if(textureID == 0)return;
+  for(it = textureCache.begin(); it != textureCache.end(); it++){
+    if(it->second.TextureID == textureID){
+      if(--it->second.refCount <= 0){
+        glDeleteTextures(1, &textureID);
+        invalidateGLState();
+        textureCache.erase(it);
+      }
+      return;
+    }
+  }
+}
+
+/* Startup texture loading: loose image files are decoded concurrently on a
+   pool of worker threads while the GL thread uploads each one through a
+   pixel buffer as soon as it is ready. Results land in textureCache, so the
+   later acquireTexture calls find them. Pack entries need no decoding and
+   are uploaded directly. */
+class TextureLoader{
+public:
+  void load(const char **filenames, int count);
+  void report();
+private:
+  struct Job {
+    string filename;
+    unsigned char *image;
+    int width;
+    int height;
+    int worker; // -1 when taken from the pack
+    double decodeStart, decodeEnd;
+    double uploadStart, uploadEnd;
+  };
+  static void* workerMain(void *arg);
+  void upload(Job &job);
+  vector<Job> jobs;
+  vector<int> toDecode; // job indices, handed out in order to the workers
+  vector<int> decoded;  // job indices ready for upload
+  int nextDecode;
+  int nextWorker;
+  pthread_mutex_t mutex;
+  pthread_cond_t ready;
+  double startTime, endTime;
+};
+
+void* TextureLoader::workerMain(void *arg){
+  TextureLoader *loader = (TextureLoader*)arg;
+  pthread_mutex_lock(&loader->mutex);
+  int worker = loader->nextWorker++;
+  while(loader->nextDecode < loader->toDecode.size()){
+    int index = loader->toDecode[loader->nextDecode++];
+    pthread_mutex_unlock(&loader->mutex);
+    Job &job = loader->jobs[index];
+    job.worker = worker;
+    job.decodeStart = currentTime();
+    job.image = SOIL_load_image(job.filename.c_str(), &job.width, &job.height, 0, SOIL_LOAD_RGB);
+    job.decodeEnd = currentTime();
+    pthread_mutex_lock(&loader->mutex);
+    loader->decoded.push_back(index);
+    pthread_cond_signal(&loader->ready);
+  }
+  pthread_mutex_unlock(&loader->mutex);
+  return NULL;
+}
+
+/* Upload a decoded image through the bound pixel unpack buffer */
+void TextureLoader::upload(Job &job){
+  job.uploadStart = currentTime();
+  if(job.image == NULL){
+    // Leave it out of the cache, acquireTexture retries and reports the error
+    cout << "Could not decode " << job.filename << endl;
+    job.uploadEnd = job.uploadStart;
+    return;
+  }
+  GLsizeiptr size = (GLsizeiptr)job.width * job.height * 3;
+  // Orphan the previous image so the driver never stalls on a pending transfer
+  glBufferData(GL_PIXEL_UNPACK_BUFFER, size, NULL, GL_STREAM_DRAW);
+  void *pixels = glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, size, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+  memcpy(pixels, job.image, size);
+  glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+  SOIL_free_image_data(job.image);
+  job.image = NULL;
+
+  GLuint TextureID = genTexture();
+  glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+  glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, job.width, job.height, 0, GL_RGB, GL_UNSIGNED_BYTE, (void*)0);
+  glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+  glGenerateMipmap(GL_TEXTURE_2D);
+  stateBindTexture(0, 0);
+  CachedTexture tex;
+  tex.TextureID = TextureID;
+  tex.refCount = 0;
+  textureCache[job.filename] = tex;
+  job.uploadEnd = currentTime();
+}
+
+/* Blocks until every file is in textureCache, call from the GL thread */
+void TextureLoader::load(const char **filenames, int count){
+  startTime = currentTime();
+  jobs.clear();
+  toDecode.clear();
+  decoded.clear();
+  for(int i = 0; i < count; i++){
+    if(textureCache.count(filenames[i]))continue;
+    Job job;
+    job.filename = filenames[i];
+    job.image = NULL;
+    job.width = job.height = 0;
+    job.worker = -1;
+    job.decodeStart = job.decodeEnd = job.uploadStart = job.uploadEnd = startTime;
+    if(assetPack.find(filenames[i], PACK_TEXTURE) == NULL)
+      toDecode.push_back(jobs.size());
+    jobs.push_back(job);
+  }
+
+  // jobs must not grow from here on, the workers hold references into it
+  int threads = sysconf(_SC_NPROCESSORS_ONLN);
+  if(threads < 1)threads = 1;
+  if(threads > toDecode.size())threads = toDecode.size();
+  vector<pthread_t> workers(threads);
+  pthread_mutex_init(&mutex, NULL);
+  pthread_cond_init(&ready, NULL);
+  nextDecode = nextWorker = 0;
+  for(int i = 0; i < threads; i++)
+    pthread_create(&workers[i], NULL, workerMain, this);
+
+  // Baked textures need no decoding, upload them while the workers run
+  for(int i = 0; i < jobs.size(); i++){
+    if(find(toDecode.begin(), toDecode.end(), i) != toDecode.end())continue;
+    jobs[i].uploadStart = currentTime();
+    CachedTexture tex;
+    tex.TextureID = createTexture(jobs[i].filename.c_str());
+    tex.refCount = 0;
+    if(tex.TextureID != 0)
+      textureCache[jobs[i].filename] = tex;
+    jobs[i].uploadEnd = currentTime();
+  }
+
+  GLuint unpackBuffer;
+  glGenBuffers(1, &unpackBuffer);
+  glBindBuffer(GL_PIXEL_UNPACK_BUFFER, unpackBuffer);
+  for(int uploaded = 0; uploaded < toDecode.size(); uploaded++){
+    pthread_mutex_lock(&mutex);
+    while(decoded.empty())
+      pthread_cond_wait(&ready, &mutex);
+    int index = decoded.front();
+    decoded.erase(decoded.begin());
+    pthread_mutex_unlock(&mutex);
+    upload(jobs[index]);
+  }
+  glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+  glDeleteBuffers(1, &unpackBuffer);
+
+  for(int i = 0; i < threads; i++)
+    pthread_join(workers[i], NULL);
+  pthread_cond_destroy(&ready);
+  pthread_mutex_destroy(&mutex);
+  endTime = currentTime();
+}
+
+/* Per asset timeline in milliseconds from the start of load() */
+void TextureLoader::report(){
+  double decodeTotal = 0, uploadTotal = 0;
+  cout << "Texture loading timeline (ms)" << endl;
+  for(int i = 0; i < jobs.size(); i++){
+    Job &job = jobs[i];
+    decodeTotal += job.decodeEnd - job.decodeStart;
+    uploadTotal += job.uploadEnd - job.uploadStart;
+    printf("  %-12s ", job.filename.c_str());
+    if(job.worker < 0)
+      printf("pack        decode      -          ");
+    else
+      printf("worker %-3d  decode %6.1f-%6.1f  ", job.worker, (job.decodeStart - startTime)*1000.0, (job.decodeEnd - startTime)*1000.0);
+    printf("upload %6.1f-%6.1f\n", (job.uploadStart - startTime)*1000.0, (job.uploadEnd - startTime)*1000.0);
+  }
+  printf("  total %.1f ms wall, %.1f ms decoding, %.1f ms uploading\n", (endTime - startTime)*1000.0, decodeTotal*1000.0, uploadTotal*1000.0);
+}
+
 float calculateDistance(float x1, float y1, float z1, float x2, float y2, float z2){
   float dist = (x1-x2) * (x1-x2) + (y1-y2)*(y1-y2) + (z1-z1)*(z1-z2);
   return sqrt(dist);
 }
 
 
-Cuboid::Cuboid(GLMatrices *mtx, GLuint textureID, float *color, float x, float y, float z, float length, float width, float height, int type)
+/* Key identifying a unique box mesh: dimensions plus UV layout (type) */
+struct CuboidMeshKey {
+  float length;
+  float width;
+  float height;
+  int type;
+  bool operator<(const CuboidMeshKey &o) const {
+    if(length != o.length)return length < o.length;
+    if(width != o.width)return width < o.width;
+    if(height != o.height)return height < o.height;
+    return type < o.type;
+  }
+};
+
+struct CuboidMesh {
+  VAO *vao;
+  int refCount;
+};
+
+map<CuboidMeshKey, CuboidMesh> cuboidMeshCache;
+
+const int CUBOID_VERTICES = 24;
+const int CUBOID_INDICES = 36;
+
+/* Fill the indexed box in model space: 24*3 positions, 24*2 texture coords
+   and 36 indices. Each face owns 4 corners (a,b,c,d) and is split into the
+   triangles (a,b,c) and (a,d,c); UVs are a(1,0) b(1,1) c(0,1) d(0,0).
+   type 0 textures only the top face, type 1 every face but the bottom. */
+void buildCuboidMeshData(float length, float width, float height, int type, GLfloat *vertex_buffer_data, GLfloat *texture_buffer_data, GLushort *index_buffer_data)
 {
-  vertex_buffer_data = new GLfloat[36*3];
-  color_buffer_data = new GLfloat[36*3];
-  texture_buffer_data = new GLfloat[36 * 2];
-  this->textureID = textureID;
-  this->mtx  = mtx;
-  this->initX = x;
-  this->initZ = z;
-  this->initY = y;
-  this->x = x;
-  this->y = y;
-  this->z = z;
-  this->length = length;
-  this->width = width;
-  this->height = height;
-  this->axis = glm::vec3(0.0f,1.0f,0.0f);
-  this->angle = 0.0f;
-  float tvert[8*3];
+  // Corner signs (x,y,z) of the box corners 1..8
+  static const float corners[8][3] = {
+    { 1, 1,-1}, { 1,-1,-1}, { 1,-1, 1}, { 1, 1, 1},
+    {-1, 1,-1}, {-1,-1,-1}, {-1,-1, 1}, {-1, 1, 1}
+  };
+  // Faces in draw order: +X, top, -Z, bottom, +Z, -X (corner numbers are 1 based)
+  static const int faces[6][4] = {
+    {1, 2, 3, 4}, {1, 4, 8, 5}, {1, 2, 6, 5}, {2, 3, 7, 6}, {4, 3, 7, 8}, {5, 6, 7, 8}
+  };
+  static const bool textured[2][6] = {
+    {false, true, false, false, false, false},
+    {true, true, true, false, true, true}
+  };
+  static const float faceUV[4][2] = { {1, 0}, {1, 1}, {0, 1}, {0, 0} };
+
+  for(int f = 0; f < 6; f++){
+    for(int c = 0; c < 4; c++){
+      int v = 4*f + c;
+      const float *corner = corners[faces[f][c] - 1];
+      vertex_buffer_data[3*v] = corner[0] * width/2.0f;
+      vertex_buffer_data[3*v + 1] = corner[1] * height/2.0f;
+      vertex_buffer_data[3*v + 2] = corner[2] * length/2.0f;
+      bool uv = textured[type == 1 ? 1 : 0][f];
+      texture_buffer_data[2*v] = uv ? faceUV[c][0] : 0;
+      texture_buffer_data[2*v + 1] = uv ? faceUV[c][1] : 0;
+    }
+    index_buffer_data[6*f] = 4*f;
+    index_buffer_data[6*f + 1] = 4*f + 1;
+    index_buffer_data[6*f + 2] = 4*f + 2;
+    index_buffer_data[6*f + 3] = 4*f;
+    index_buffer_data[6*f + 4] = 4*f + 3;
+    index_buffer_data[6*f + 5] = 4*f + 2;
+  }
+}
 
-  tvert[0] = width/2.0f;	//1
-  tvert[1] = height/2.0f;
-  tvert[2] = -1.0f * length/2.0f;
+/* Build the box and upload it, texture is bound per Cuboid at draw time */
+struct VAO* buildCuboidMesh(float length, float width, float height, int type)
+{
+  GLfloat vertex_buffer_data[CUBOID_VERTICES*3];
+  GLfloat texture_buffer_data[CUBOID_VERTICES*2];
+  GLushort index_buffer_data[CUBOID_INDICES];
+  buildCuboidMeshData(length, width, height, type, vertex_buffer_data, texture_buffer_data, index_buffer_data);
+  return create3DTexturedObject(GL_TRIANGLES, CUBOID_VERTICES, vertex_buffer_data, texture_buffer_data, CUBOID_INDICES, GL_UNSIGNED_SHORT, index_buffer_data, 0, GL_FILL);
+}
 
-  tvert[3] = width/2.0f;	//2
-  tvert[4] = -1.0f * height/2.0f;
-  tvert[5] = -1.0f * length/2.0f;
+/* Hand out the shared mesh for these dimensions, building it on first use */
+struct VAO* acquireCuboidMesh(float length, float width, float height, int type)
+{
+  CuboidMeshKey key = {length, width, height, type};
+  map<CuboidMeshKey, CuboidMesh>::iterator it = cuboidMeshCache.find(key);
+  if(it == cuboidMeshCache.end()){
+    CuboidMesh mesh;
+    mesh.vao = buildCuboidMesh(length, width, height, type);
+    mesh.refCount = 0;
+    it = cuboidMeshCache.insert(make_pair(key, mesh)).first;
+  }
+  it->second.refCount++;
+  return it->second.vao;
+}
 
-  tvert[6] = width/2.0f;	//3
-  tvert[7] = -1.0f * height/2.0f;
-  tvert[8] = length/2.0f;
+/* Drop a reference, the GL buffers go away with the last Cuboid using them */
+void releaseCuboidMesh(float length, float width, float height, int type)
+{
+  CuboidMeshKey key = {length, width, height, type};
+  map<CuboidMeshKey, CuboidMesh>::iterator it = cuboidMeshCache.find(key);
+  if(it == cuboidMeshCache.end())return;
+  if(--it->second.refCount > 0)return;
+  VAO *vao = it->second.vao;
+  glDeleteBuffers(1, &vao->VertexBuffer);
+  glDeleteBuffers(1, &vao->TextureBuffer);
+  glDeleteBuffers(1, &vao->IndexBuffer);
+  glDeleteVertexArrays(1, &vao->VertexArrayID);
+  invalidateGLState(); // the deleted names may be handed out again
+  delete vao;
+  cuboidMeshCache.erase(it);
+}
 
-  tvert[9] = width/2.0f;	//4
-  tvert[10] = height/2.0f;
-  tvert[11] = length/2.0f;
-
-  tvert[12] = -1.0f * width/2.0f;	//5
-  tvert[13] = height/2.0f;
-  tvert[14] = -1.0f * length/2.0f;
-
-  tvert[15] = -1.0f * width/2.0f;	//6
-  tvert[16] = -1.0f * height/2.0f;
-  tvert[17] = -1.0f * length/2.0f;
-
-  tvert[18] = -1.0f * width/2.0f;	//7
-  tvert[19] = -1.0f * height/2.0f;
-  tvert[20] = length/2.0f;
-
-  tvert[21] = -1.0f * width/2.0f;	//8
-  tvert[22] = height/2.0f;
-  tvert[23] = length/2.0f;
-
-//*********
-
-  //Triangle 1
-  vertex_buffer_data[0] = tvert[0];   //1
-  vertex_buffer_data[1] = tvert[1];
-  vertex_buffer_data[2] = tvert[2];	
-
-  vertex_buffer_data[3] = tvert[3];   //2
-  vertex_buffer_data[4] = tvert[4];
-  vertex_buffer_data[5] = tvert[5];	
-
-  vertex_buffer_data[6] = tvert[6];   //3
-  vertex_buffer_data[7] = tvert[7];
-  vertex_buffer_data[8] = tvert[8];	
-
-  //Triangle 2
-  vertex_buffer_data[9] = tvert[0];   //1
-  vertex_buffer_data[10] = tvert[1];
-  vertex_buffer_data[11] = tvert[2];	
-
-  vertex_buffer_data[12] = tvert[9];   //4
-  vertex_buffer_data[13] = tvert[10];
-  vertex_buffer_data[14] = tvert[11];	
-
-  vertex_buffer_data[15] = tvert[6];   //3
-  vertex_buffer_data[16] = tvert[7];
-  vertex_buffer_data[17] = tvert[8];
-
-  //Triangle 3
-  vertex_buffer_data[18] = tvert[0];   //1
-  vertex_buffer_data[19] = tvert[1];
-  vertex_buffer_data[20] = tvert[2];	
-
-  vertex_buffer_data[21] = tvert[9];   //4
-  vertex_buffer_data[22] = tvert[10];
-  vertex_buffer_data[23] = tvert[11];	
-
-  vertex_buffer_data[24] = tvert[21];   //8
-  vertex_buffer_data[25] = tvert[22];
-  vertex_buffer_data[26] = tvert[23];	
-
-   //Triangle 4
-  vertex_buffer_data[27] = tvert[0];   //1
-  vertex_buffer_data[28] = tvert[1];
-  vertex_buffer_data[29] = tvert[2];	
-
-  vertex_buffer_data[30] = tvert[12];   //5
-  vertex_buffer_data[31] = tvert[13];
-  vertex_buffer_data[32] = tvert[14];	
-
-  vertex_buffer_data[33] = tvert[21];   //8
-  vertex_buffer_data[34] = tvert[22];
-  vertex_buffer_data[35] = tvert[23];
-
-     //Triangle 5
-  vertex_buffer_data[36] = tvert[0];   //1
-  vertex_buffer_data[37] = tvert[1];
-  vertex_buffer_data[38] = tvert[2];	
-
-  vertex_buffer_data[39] = tvert[3];   //2
-  vertex_buffer_data[40] = tvert[4];
-  vertex_buffer_data[41] = tvert[5];	
-
-  vertex_buffer_data[42] = tvert[15];   //6
-  vertex_buffer_data[43] = tvert[16];
-  vertex_buffer_data[44] = tvert[17];
-
-  //Triangle 6
-  vertex_buffer_data[45] = tvert[0];   //1
-  vertex_buffer_data[46] = tvert[1];
-  vertex_buffer_data[47] = tvert[2];	
-
-  vertex_buffer_data[48] = tvert[12];   //5
-  vertex_buffer_data[49] = tvert[13];
-  vertex_buffer_data[50] = tvert[14];	
-
-  vertex_buffer_data[51] = tvert[15];   //6
-  vertex_buffer_data[52] = tvert[16];
-  vertex_buffer_data[53] = tvert[17];
-
-    //Triangle 7
-  vertex_buffer_data[54] = tvert[3];   //2
-  vertex_buffer_data[55] = tvert[4];
-  vertex_buffer_data[56] = tvert[5];	
-
-  vertex_buffer_data[57] = tvert[6];   //3
-  vertex_buffer_data[58] = tvert[7];
-  vertex_buffer_data[59] = tvert[8];	
-
-  vertex_buffer_data[60] = tvert[18];   //7
-  vertex_buffer_data[61] = tvert[19];
-  vertex_buffer_data[62] = tvert[20];
-
-      //Triangle 8
-  vertex_buffer_data[63] = tvert[3];   //2
-  vertex_buffer_data[64] = tvert[4];
-  vertex_buffer_data[65] = tvert[5];	
-
-  vertex_buffer_data[66] = tvert[15];   //6
-  vertex_buffer_data[67] = tvert[16];
-  vertex_buffer_data[68] = tvert[17];	
-
-  vertex_buffer_data[69] = tvert[18];   //7
-  vertex_buffer_data[70] = tvert[19];
-  vertex_buffer_data[71] = tvert[20];
-
-        //Triangle 9
-  vertex_buffer_data[72] = tvert[9];   //4
-  vertex_buffer_data[73] = tvert[10];
-  vertex_buffer_data[74] = tvert[11];	
-
-  vertex_buffer_data[75] = tvert[6];   //3
-  vertex_buffer_data[76] = tvert[7];
-  vertex_buffer_data[77] = tvert[8];	
-
-  vertex_buffer_data[78] = tvert[18];   //7
-  vertex_buffer_data[79] = tvert[19];
-  vertex_buffer_data[80] = tvert[20];
-
-  		//Triangle 10
-  vertex_buffer_data[81] = tvert[9];   //4
-  vertex_buffer_data[82] = tvert[10];
-  vertex_buffer_data[83] = tvert[11];	
-
-  vertex_buffer_data[84] = tvert[21];   //8
-  vertex_buffer_data[85] = tvert[22];   
-  vertex_buffer_data[86] = tvert[23];   
-
-  vertex_buffer_data[87] = tvert[18];   //7
-  vertex_buffer_data[88] = tvert[19];
-  vertex_buffer_data[89] = tvert[20];
-
-  //Triangle 11
-  vertex_buffer_data[90] = tvert[12];   //5
-  vertex_buffer_data[91] = tvert[13];
-  vertex_buffer_data[92] = tvert[14];	
-
-  vertex_buffer_data[93] = tvert[15];   //6
-  vertex_buffer_data[94] = tvert[16];
-  vertex_buffer_data[95] = tvert[17];	
-
-  vertex_buffer_data[96] = tvert[18];   //7
-  vertex_buffer_data[97] = tvert[19];
-  vertex_buffer_data[98] = tvert[20];
-
-  //Triangle 12
-  vertex_buffer_data[99] = tvert[12];   //5
-  vertex_buffer_data[100] = tvert[13];
-  vertex_buffer_data[101] = tvert[14];	
-
-  vertex_buffer_data[102] = tvert[21];   //8
-  vertex_buffer_data[103] = tvert[22];
-  vertex_buffer_data[104] = tvert[23];	
-
-  vertex_buffer_data[105] = tvert[18];   //7
-  vertex_buffer_data[106] = tvert[19];
-  vertex_buffer_data[107] = tvert[20];
-
-  for(int i = 0; i < 36 * 3; i+=3){
- 	color_buffer_data[i] = color[0];
- 	color_buffer_data[i + 1] = color[1];
- 	color_buffer_data[i + 2] = color[2];
- }
+EntityHandle EntityStore::create(float x, float y, float z, float width, float height, float length){
+  EntityHandle handle;
+  if(freeSlots.empty()){
+    Slot slot;
+    slot.generation = 0;
+    slots.push_back(slot);
+    handle.index = slots.size() - 1;
+  }
+  else{
+    handle.index = freeSlots.back();
+    freeSlots.pop_back();
+  }
+  handle.generation = slots[handle.index].generation;
+  slots[handle.index].dense = this->x.size();
+  this->x.push_back(x);
+  this->y.push_back(y);
+  this->z.push_back(z);
+  halfX.push_back(width/2.0f);
+  halfY.push_back(height/2.0f);
+  halfZ.push_back(length/2.0f);
+  angle.push_back(0.0f);
+  velX.push_back(0.0f);
+  velZ.push_back(0.0f);
+  blinkTime.push_back(0.0f);
+  turnTime.push_back(0.0f);
+  flags.push_back(ENTITY_VISIBLE | ENTITY_SHOWN | ENTITY_ALIVE);
+  slotOf.push_back(handle.index);
+  grid.insert(handle.index, x - width/2.0f, z - length/2.0f, x + width/2.0f, z + length/2.0f);
+  return handle;
+}
 
- for(int i = 0; i < 36 * 2; i+=2){
-  texture_buffer_data[i] = 0;
-  texture_buffer_data[i+1] = 0;
- }
-                                //Cube coords   //vertex buffer coords
- texture_buffer_data[12] = 1;   //1             
- texture_buffer_data[13] = 0;
+void EntityStore::destroy(EntityHandle handle){
+  if(!isValid(handle))return;
+  grid.remove(handle.index);
+  if(flags[slots[handle.index].dense] & ENTITY_DYNAMIC)
+    sweepAndPrune.remove(handle.index);
+  pairs.clear();
+  int last = size() - 1;
+  move(last, slots[handle.index].dense);
+  pop();
+  slots[handle.index].dense = -1;
+  slots[handle.index].generation++;
+  freeSlots.push_back(handle.index);
+}
 
- texture_buffer_data[14] = 1;   //4
- texture_buffer_data[15] = 1;
+bool EntityStore::isValid(EntityHandle handle){
+  return handle.index < slots.size() && slots[handle.index].generation == handle.generation && slots[handle.index].dense >= 0;
+}
+
+int EntityStore::dense(EntityHandle handle){
+  return slots[handle.index].dense;
+}
+
+int EntityStore::size(){
+  return x.size();
+}
+
+/* Snapshots are indexed by slot, so they hold this many states */
+int EntityStore::getSlotCount(){
+  return slots.size();
+}
+
+/* Boxes touching counts, as it always did */
+bool EntityStore::overlaps(int a, int b){
+  return fabs(x[a] - x[b]) <= halfX[a] + halfX[b] &&
+         fabs(y[a] - y[b]) <= halfY[a] + halfY[b] &&
+         fabs(z[a] - z[b]) <= halfZ[a] + halfZ[b];
+}
+
+/* Call once the tick's movement is done, before any query. Only entities
+   that crossed into other cells are relinked. */
+void EntityStore::updateGrid(){
+  for(int i = 0; i < size(); i++)
+    grid.move(slotOf[i], x[i] - halfX[i], z[i] - halfZ[i], x[i] + halfX[i], z[i] + halfZ[i]);
+}
+
+/* Dense indices of the entities in the cells 'box' touches */
+void EntityStore::queryBox(const float *box, vector<int> &result){
+  grid.query(box[0], box[2], box[3], box[5], found);
+  result.clear();
+  for(int i = 0; i < found.size(); i++)
+    result.push_back(slots[found[i]].dense);
+}
 
- texture_buffer_data[16] = 0;   //8
- texture_buffer_data[17] = 1;
+/* (minX, minY, minZ, maxX, maxY, maxZ) of the entity */
+void EntityStore::boundsOf(int entity, float *box){
+  box[0] = x[entity] - halfX[entity];
+  box[1] = y[entity] - halfY[entity];
+  box[2] = z[entity] - halfZ[entity];
+  box[3] = x[entity] + halfX[entity];
+  box[4] = y[entity] + halfY[entity];
+  box[5] = z[entity] + halfZ[entity];
+}
 
- texture_buffer_data[18] = 1;   //1
- texture_buffer_data[19] = 0;
+/* Dense indices of the entities sharing a cell with 'entity', itself
+   included. Candidates only, test them with overlaps(). */
+void EntityStore::query(int entity, vector<int> &result){
+  grid.query(x[entity] - halfX[entity], z[entity] - halfZ[entity], x[entity] + halfX[entity], z[entity] + halfZ[entity], found);
+  result.clear();
+  for(int i = 0; i < found.size(); i++)
+    result.push_back(slots[found[i]].dense);
+}
 
- texture_buffer_data[20] = 0;   //5
- texture_buffer_data[21] = 0;
+SpatialHash::SpatialHash() : buckets(BUCKETS), mark(0) {
+}
 
- texture_buffer_data[22] = 0;   //8
- texture_buffer_data[23] = 1;
+SpatialHash::CellRange SpatialHash::cellsOf(float minX, float minZ, float maxX, float maxZ){
+  CellRange range;
+  range.minX = (int)floor(minX / TILE_WIDTH);
+  range.minZ = (int)floor(minZ / TILE_LENGTH);
+  range.maxX = (int)floor(maxX / TILE_WIDTH);
+  range.maxZ = (int)floor(maxZ / TILE_LENGTH);
+  range.linked = true;
+  return range;
+}
 
- if(type == 1){
-  //side 1
-  //tri 1
-  texture_buffer_data[0] = 1;
-  texture_buffer_data[1] = 0;
+int SpatialHash::bucketOf(int cellX, int cellZ){
+  return ((uint32_t)cellX * 73856093u ^ (uint32_t)cellZ * 19349663u) & (BUCKETS - 1);
+}
 
-  texture_buffer_data[2] = 1;
-  texture_buffer_data[3] = 1;
+void SpatialHash::link(uint32_t slot){
+  const CellRange &range = ranges[slot];
+  for(int cz = range.minZ; cz <= range.maxZ; cz++)
+    for(int cx = range.minX; cx <= range.maxX; cx++)
+      buckets[bucketOf(cx, cz)].push_back(slot);
+}
 
-  texture_buffer_data[4] = 0;
-  texture_buffer_data[5] = 1;
+void SpatialHash::unlink(uint32_t slot){
+  const CellRange &range = ranges[slot];
+  for(int cz = range.minZ; cz <= range.maxZ; cz++)
+    for(int cx = range.minX; cx <= range.maxX; cx++){
+      vector<uint32_t> &bucket = buckets[bucketOf(cx, cz)];
+      vector<uint32_t>::iterator it = find(bucket.begin(), bucket.end(), slot);
+      if(it != bucket.end()){
+        *it = bucket.back();
+        bucket.pop_back();
+      }
+    }
+}
 
-  //tri 2
-  texture_buffer_data[6] = 1;
-  texture_buffer_data[7] = 0;
+void SpatialHash::insert(uint32_t slot, float minX, float minZ, float maxX, float maxZ){
+  if(slot >= ranges.size()){
+    CellRange none = {0, 0, -1, -1, false};
+    ranges.resize(slot + 1, none);
+    marks.resize(slot + 1, 0);
+  }
+  ranges[slot] = cellsOf(minX, minZ, maxX, maxZ);
+  link(slot);
+}
 
-  texture_buffer_data[8] = 0;
-  texture_buffer_data[9] = 0;
+void SpatialHash::remove(uint32_t slot){
+  if(slot >= ranges.size() || !ranges[slot].linked)return;
+  unlink(slot);
+  ranges[slot].linked = false;
+}
 
-  texture_buffer_data[10] = 0;
-  texture_buffer_data[11] = 1;
+bool SpatialHash::move(uint32_t slot, float minX, float minZ, float maxX, float maxZ){
+  CellRange range = cellsOf(minX, minZ, maxX, maxZ);
+  const CellRange &old = ranges[slot];
+  if(old.minX == range.minX && old.minZ == range.minZ && old.maxX == range.maxX && old.maxZ == range.maxZ)
+    return false;
+  unlink(slot);
+  ranges[slot] = range;
+  link(slot);
+  return true;
+}
 
-  //side2
-  //tri 5
-  texture_buffer_data[24] = 1;
-  texture_buffer_data[25] = 0;
+void SpatialHash::query(float minX, float minZ, float maxX, float maxZ, vector<uint32_t> &slots){
+  CellRange range = cellsOf(minX, minZ, maxX, maxZ);
+  slots.clear();
+  if(++mark == 0){
+    fill(marks.begin(), marks.end(), 0);
+    mark = 1;
+  }
+  for(int cz = range.minZ; cz <= range.maxZ; cz++)
+    for(int cx = range.minX; cx <= range.maxX; cx++){
+      const vector<uint32_t> &bucket = buckets[bucketOf(cx, cz)];
+      for(int i = 0; i < bucket.size(); i++){
+        uint32_t slot = bucket[i];
+        if(marks[slot] == mark)continue;
+        marks[slot] = mark;
+        slots.push_back(slot);
+      }
+    }
+}
 
-  texture_buffer_data[26] = 1;
-  texture_buffer_data[27] = 1;
+AabbBatch::AabbBatch() : count(0) {
+}
 
-  texture_buffer_data[28] = 0;
-  texture_buffer_data[29] = 1;
+void AabbBatch::clear(){
+  minX.clear(); minY.clear(); minZ.clear();
+  maxX.clear(); maxY.clear(); maxZ.clear();
+  entity.clear();
+  count = 0;
+}
 
-  //tri 6
-  texture_buffer_data[30] = 1;
-  texture_buffer_data[31] = 0;
+void AabbBatch::add(int entity, float minX, float minY, float minZ, float maxX, float maxY, float maxZ){
+  // Drop the padding of the last pad()
+  this->minX.resize(count); this->minY.resize(count); this->minZ.resize(count);
+  this->maxX.resize(count); this->maxY.resize(count); this->maxZ.resize(count);
+  this->minX.push_back(minX); this->minY.push_back(minY); this->minZ.push_back(minZ);
+  this->maxX.push_back(maxX); this->maxY.push_back(maxY); this->maxZ.push_back(maxZ);
+  this->entity.push_back(entity);
+  count++;
+}
 
-  texture_buffer_data[32] = 0;
-  texture_buffer_data[33] = 0;
+/* Call after the last add(), before running a kernel */
+void AabbBatch::pad(){
+  int padded = (count + 7) & ~7;
+  minX.resize(padded, FLT_MAX); minY.resize(padded, FLT_MAX); minZ.resize(padded, FLT_MAX);
+  maxX.resize(padded, -FLT_MAX); maxY.resize(padded, -FLT_MAX); maxZ.resize(padded, -FLT_MAX);
+}
 
-  texture_buffer_data[34] = 0;
-  texture_buffer_data[35] = 1;
+void overlapScalar(const float *box, const AabbBatch &batch, uint32_t *mask){
+  memset(mask, 0, (batch.count + 31) / 32 * sizeof(uint32_t));
+  for(int i = 0; i < batch.count; i++){
+    if(batch.minX[i] <= box[3] && batch.maxX[i] >= box[0] &&
+       batch.minY[i] <= box[4] && batch.maxY[i] >= box[1] &&
+       batch.minZ[i] <= box[5] && batch.maxZ[i] >= box[2])
+      mask[i / 32] |= 1u << (i % 32);
+  }
+}
 
-  //side 3
-  //tri 9
-  texture_buffer_data[48] = 1;
-  texture_buffer_data[49] = 0;
+#ifdef OVERLAP_SIMD_X86
+/* 4 boxes per step. Padding boxes never set a bit, so no tail loop. */
+__attribute__((target("sse2")))
+void overlapSSE(const float *box, const AabbBatch &batch, uint32_t *mask){
+  memset(mask, 0, (batch.count + 31) / 32 * sizeof(uint32_t));
+  __m128 loX = _mm_set1_ps(box[0]), loY = _mm_set1_ps(box[1]), loZ = _mm_set1_ps(box[2]);
+  __m128 hiX = _mm_set1_ps(box[3]), hiY = _mm_set1_ps(box[4]), hiZ = _mm_set1_ps(box[5]);
+  for(int i = 0; i < batch.count; i += 4){
+    __m128 hit = _mm_and_ps(_mm_cmple_ps(_mm_loadu_ps(&batch.minX[i]), hiX), _mm_cmpge_ps(_mm_loadu_ps(&batch.maxX[i]), loX));
+    hit = _mm_and_ps(hit, _mm_and_ps(_mm_cmple_ps(_mm_loadu_ps(&batch.minY[i]), hiY), _mm_cmpge_ps(_mm_loadu_ps(&batch.maxY[i]), loY)));
+    hit = _mm_and_ps(hit, _mm_and_ps(_mm_cmple_ps(_mm_loadu_ps(&batch.minZ[i]), hiZ), _mm_cmpge_ps(_mm_loadu_ps(&batch.maxZ[i]), loZ)));
+    mask[i / 32] |= (uint32_t)_mm_movemask_ps(hit) << (i % 32);
+  }
+}
 
-  texture_buffer_data[50] = 1;
-  texture_buffer_data[51] = 1;
+/* 8 boxes per step */
+__attribute__((target("avx2")))
+void overlapAVX2(const float *box, const AabbBatch &batch, uint32_t *mask){
+  memset(mask, 0, (batch.count + 31) / 32 * sizeof(uint32_t));
+  __m256 loX = _mm256_set1_ps(box[0]), loY = _mm256_set1_ps(box[1]), loZ = _mm256_set1_ps(box[2]);
+  __m256 hiX = _mm256_set1_ps(box[3]), hiY = _mm256_set1_ps(box[4]), hiZ = _mm256_set1_ps(box[5]);
+  for(int i = 0; i < batch.count; i += 8){
+    __m256 hit = _mm256_and_ps(_mm256_cmp_ps(_mm256_loadu_ps(&batch.minX[i]), hiX, _CMP_LE_OQ), _mm256_cmp_ps(_mm256_loadu_ps(&batch.maxX[i]), loX, _CMP_GE_OQ));
+    hit = _mm256_and_ps(hit, _mm256_and_ps(_mm256_cmp_ps(_mm256_loadu_ps(&batch.minY[i]), hiY, _CMP_LE_OQ), _mm256_cmp_ps(_mm256_loadu_ps(&batch.maxY[i]), loY, _CMP_GE_OQ)));
+    hit = _mm256_and_ps(hit, _mm256_and_ps(_mm256_cmp_ps(_mm256_loadu_ps(&batch.minZ[i]), hiZ, _CMP_LE_OQ), _mm256_cmp_ps(_mm256_loadu_ps(&batch.maxZ[i]), loZ, _CMP_GE_OQ)));
+    mask[i / 32] |= (uint32_t)_mm256_movemask_ps(hit) << (i % 32);
+  }
+}
+#endif
+
+OverlapKernel overlapKernel = overlapScalar;
+const char *overlapKernelName = "scalar";
+
+/* Continuous collision: 'box' moving by (dx, dy, dz) against the still
+   'target', both as (minX, minY, minZ, maxX, maxY, maxZ). Slab test of the
+   box centre against the target grown by the box's half extents. Sets
+   't' to the fraction of the move at first contact, 0 if they already
+   overlap. Touching and moving apart is not a hit. */
+bool sweepBox(const float *box, float dx, float dy, float dz, const float *target, float &t){
+  float move[3] = {dx, dy, dz};
+  float enter = -FLT_MAX, leave = FLT_MAX;
+  for(int a = 0; a < 3; a++){
+    float half = (box[a + 3] - box[a]) / 2.0f;
+    float centre = box[a] + half;
+    float lo = target[a] - half, hi = target[a + 3] + half;
+    if(move[a] == 0.0f){
+      if(centre < lo || centre > hi)return false;
+      continue;
+    }
+    float t1 = (lo - centre) / move[a], t2 = (hi - centre) / move[a];
+    if(t1 > t2)swap(t1, t2);
+    if(t1 > enter)enter = t1;
+    if(t2 < leave)leave = t2;
+    if(enter > leave)return false;
+  }
+  if(leave <= 0.0f || enter > 1.0f)return false;
+  t = enter > 0.0f ? enter : 0.0f;
+  return true;
+}
 
-  texture_buffer_data[52] = 0;
-  texture_buffer_data[53] = 1;
+/* Picks the widest kernel the CPU runs, once at startup */
+void selectOverlapKernel(){
+#ifdef OVERLAP_SIMD_X86
+  __builtin_cpu_init();
+  if(__builtin_cpu_supports("avx2")){
+    overlapKernel = overlapAVX2;
+    overlapKernelName = "avx2";
+  }
+  else if(__builtin_cpu_supports("sse2")){
+    overlapKernel = overlapSSE;
+    overlapKernelName = "sse2";
+  }
+#endif
+}
 
-  //tri 10
-  texture_buffer_data[54] = 1;
-  texture_buffer_data[55] = 0;
+/* Moves the entity from the grid's care to the sweep and prune. The grid
+   still holds it, for queries from static entities. */
+void EntityStore::setDynamic(int entity){
+  if(flags[entity] & ENTITY_DYNAMIC)return;
+  flags[entity] |= ENTITY_DYNAMIC;
+  sweepAndPrune.insert(slotOf[entity]);
+}
 
-  texture_buffer_data[56] = 0;
-  texture_buffer_data[57] = 0;
+/* Call once the tick's movement is done. Finds every overlapping pair of
+   dynamic entities. */
+void EntityStore::sweep(){
+  sweepAndPrune.sweep(*this, pairs);
+}
 
-  texture_buffer_data[58] = 0;
-  texture_buffer_data[59] = 1;
+/* Dense indices of the dynamic entities the last sweep() paired with 'entity' */
+void EntityStore::pairedWith(int entity, vector<int> &result){
+  result.clear();
+  for(int i = 0; i < pairs.size(); i++){
+    if(pairs[i].a == entity)result.push_back(pairs[i].b);
+    else if(pairs[i].b == entity)result.push_back(pairs[i].a);
+  }
+}
 
-    //side 4
-  //tri 11
-  texture_buffer_data[60] = 1;
-  texture_buffer_data[61] = 0;
+SweepAndPrune::SweepAndPrune() : axis(0) {
+}
 
-  texture_buffer_data[62] = 1;
-  texture_buffer_data[63] = 1;
+void SweepAndPrune::insert(uint32_t slot){
+  Interval interval = {FLT_MAX, FLT_MAX, slot}; // sorted into place by the next sweep
+  intervals.push_back(interval);
+}
 
-  texture_buffer_data[64] = 0;
-  texture_buffer_data[65] = 1;
+void SweepAndPrune::remove(uint32_t slot){
+  for(int i = 0; i < intervals.size(); i++){
+    if(intervals[i].slot == slot){
+      intervals.erase(intervals.begin() + i);
+      return;
+    }
+  }
+}
 
-  //tri 12
-  texture_buffer_data[66] = 1;
-  texture_buffer_data[67] = 0;
+static bool intervalBefore(const SweepAndPrune::Interval &a, const SweepAndPrune::Interval &b){
+  return a.lo < b.lo;
+}
 
-  texture_buffer_data[68] = 0;
-  texture_buffer_data[69] = 0;
+/* Sorts on whichever of x and z the entities are spread along most, with
+   some slack so it does not flip every tick. A flip needs a full sort. */
+void SweepAndPrune::chooseAxis(EntityStore &store){
+  int n = intervals.size();
+  if(n < 2)return;
+  double sum[2] = {0.0, 0.0}, squares[2] = {0.0, 0.0};
+  for(int i = 0; i < n; i++){
+    int e = store.slots[intervals[i].slot].dense;
+    sum[0] += store.x[e];
+    squares[0] += store.x[e] * store.x[e];
+    sum[1] += store.z[e];
+    squares[1] += store.z[e] * store.z[e];
+  }
+  double spreadX = squares[0] - sum[0] * sum[0] / n;
+  double spreadZ = squares[1] - sum[1] * sum[1] / n;
+  int best = axis;
+  if(axis == 0 && spreadZ > 1.5 * spreadX)best = 2;
+  else if(axis == 2 && spreadX > 1.5 * spreadZ)best = 0;
+  if(best == axis)return;
+  axis = best;
+  for(int i = 0; i < n; i++){
+    int e = store.slots[intervals[i].slot].dense;
+    intervals[i].lo = axis == 0 ? store.x[e] - store.halfX[e] : store.z[e] - store.halfZ[e];
+  }
+  sort(intervals.begin(), intervals.end(), intervalBefore);
+}
 
-  texture_buffer_data[70] = 0;
-  texture_buffer_data[71] = 1;
+void SweepAndPrune::sweep(EntityStore &store, vector<EntityPair> &pairs){
+  int i, j, n = intervals.size();
+  pairs.clear();
+  chooseAxis(store);
+  for(i = 0; i < n; i++){
+    int e = store.slots[intervals[i].slot].dense;
+    float centre = axis == 0 ? store.x[e] : store.z[e];
+    float half = axis == 0 ? store.halfX[e] : store.halfZ[e];
+    intervals[i].lo = centre - half;
+    intervals[i].hi = centre + half;
+  }
+  // Insertion sort, last tick's order is nearly right
+  for(i = 1; i < n; i++){
+    Interval interval = intervals[i];
+    for(j = i - 1; j >= 0 && intervals[j].lo > interval.lo; j--)
+      intervals[j + 1] = intervals[j];
+    intervals[j + 1] = interval;
+  }
+  // Touching counts, as in EntityStore::overlaps
+  for(i = 0; i < n; i++){
+    int a = store.slots[intervals[i].slot].dense;
+    for(j = i + 1; j < n && intervals[j].lo <= intervals[i].hi; j++){
+      int b = store.slots[intervals[j].slot].dense;
+      if(!store.overlaps(a, b))continue;
+      EntityPair pair = {a, b};
+      pairs.push_back(pair);
+    }
+  }
+}
 
-  
+/* Packs the entities of 'candidates' that carry all of 'flags' and tests
+   them against 'entity' in one kernel call. Leaves the hits in 'hits'. */
+void EntityStore::collide(int entity, const vector<int> &candidates, uint32_t flags, vector<int> &hits){
+  float box[6];
+  boundsOf(entity, box);
+  collide(box, candidates, flags, hits, entity);
+}
 
+/* Same, against a box that need not be an entity's. 'except' is left out. */
+void EntityStore::collide(const float *box, const vector<int> &candidates, uint32_t flags, vector<int> &hits, int except){
+  batch.clear();
+  for(int k = 0; k < candidates.size(); k++){
+    int i = candidates[k];
+    if((this->flags[i] & flags) != flags || i == except)continue;
+    batch.add(i, x[i] - halfX[i], y[i] - halfY[i], z[i] - halfZ[i], x[i] + halfX[i], y[i] + halfY[i], z[i] + halfZ[i]);
+  }
+  hits.clear();
+  if(batch.count == 0)return;
+  batch.pad();
+  mask.resize((batch.count + 31) / 32);
+  overlapKernel(box, batch, &mask[0]);
+  for(int w = 0; w < mask.size(); w++)
+    for(uint32_t bits = mask[w]; bits != 0; bits &= bits - 1)
+      hits.push_back(batch.entity[w * 32 + __builtin_ctz(bits)]);
+}
 
- }
+void EntityStore::move(int from, int to){
+  if(from == to)return;
+  x[to] = x[from];
+  y[to] = y[from];
+  z[to] = z[from];
+  halfX[to] = halfX[from];
+  halfY[to] = halfY[from];
+  halfZ[to] = halfZ[from];
+  angle[to] = angle[from];
+  velX[to] = velX[from];
+  velZ[to] = velZ[from];
+  blinkTime[to] = blinkTime[from];
+  turnTime[to] = turnTime[from];
+  flags[to] = flags[from];
+  slotOf[to] = slotOf[from];
+  slots[slotOf[to]].dense = to;
+}
 
- empty = false;
- visible = true;
- sliding = false;
+void EntityStore::pop(){
+  x.pop_back();
+  y.pop_back();
+  z.pop_back();
+  halfX.pop_back();
+  halfY.pop_back();
+  halfZ.pop_back();
+  angle.pop_back();
+  velX.pop_back();
+  velZ.pop_back();
+  blinkTime.pop_back();
+  turnTime.pop_back();
+  flags.pop_back();
+  slotOf.pop_back();
+}
 
- vaobj = create3DTexturedObject(GL_TRIANGLES, 36, vertex_buffer_data, texture_buffer_data, textureID, GL_FILL);
+Cuboid::Cuboid(GLMatrices *mtx, GLuint textureID, float *color, float x, float y, float z, float length, float width, float height, int type)
+{
+  this->textureID = textureID;
+  this->mtx  = mtx;
+  this->initX = x;
+  this->initZ = z;
+  this->initY = y;
+  this->length = length;
+  this->width = width;
+  this->height = height;
+  this->type = type;
+  this->axis = glm::vec3(0.0f,1.0f,0.0f);
+  handle = entities.create(x, y, z, width, height, length);
 
+ vaobj = acquireCuboidMesh(length, width, height, type);
 }
 
 Cuboid::~Cuboid(){
-  delete[] vertex_buffer_data;
-  delete[] color_buffer_data;
-  delete[] texture_buffer_data;
+  releaseCuboidMesh(length, width, height, type);
+  entities.destroy(handle);
 }
 
+/* Every sliding tile moves together, turning at the limits */
 void undergoSliding(){
   static float factor = 0.5f;
-  int tempIdx;
-  for(int i = 0; i < NUM_TILES_ROW * NUM_TILES_COL; i++){
-    if(tilesList[i]->isSliding()){
-    	//cout<<"Cuboid:: Upper Limit"<<Cuboid::UPPER_LIMIT<<endl;
-    	//cout<<"Cuboid:: Lower Limit"<<Cuboid::LOWER_LIMIT<<endl;
-    	//cout<<"Sliding Factor "<<factor<<endl;
-    	//cout<<"Y value = "<<tilesList[i]->y<<endl;
-      tilesList[i]->y += factor;
-      tempIdx = i;
+  int last = -1;
+  for(int i = 0; i < entities.size(); i++){
+    if(entities.flags[i] & ENTITY_SLIDING){
+      entities.y[i] += factor;
+      last = i;
     }
   }
-  if(tilesList[tempIdx]->y >= Cuboid::UPPER_LIMIT)
+  if(last < 0)return;
+  if(entities.y[last] >= Cuboid::UPPER_LIMIT)
 	  factor = -0.5f;
-  else if(tilesList[tempIdx]->y <= Cuboid::LOWER_LIMIT)
+  else if(entities.y[last] <= Cuboid::LOWER_LIMIT)
 	  factor = 0.5f;
 }
 
+/* Dense index in the entity store, simulation side only */
+int Cuboid::getEntity(){
+  return entities.dense(handle);
+}
+
 void Cuboid::setX(float value){
-	x = value;
+	entities.x[getEntity()] = value;
 }
 void Cuboid::setY(float value){
-	y = value;
+	entities.y[getEntity()] = value;
 }
 void Cuboid::setZ(float value){
-	z = value;
+	entities.z[getEntity()] = value;
 }
 
-void Cuboid::draw(){
-  glm::mat4 MVP;
-  mtx->model = glm::mat4(1.0f);
-  glm::mat4 translateCube = glm::translate(glm::vec3(x, y, z)); 
-  glm::mat4 t1 = glm::translate(glm::vec3(initX, initY, initZ)); 
-  glm::mat4 rotateCube = glm::rotate((float)(angle*M_PI/180.0f), axis); // rotate about vector (-1,1,1)
-  mtx->model *= ( translateCube * rotateCube );
-  MVP =  mtx->projection * mtx->view * mtx->model; // MVP = p * V * M
-  //  Don't change unless you are sure!!
-  glUniformMatrix4fv(mtx->TexMatrixID, 1, GL_FALSE, &MVP[0][0]);
-  glUniform1i(glGetUniformLocation(textureProgramID, "texSampler"), 0);
-  draw3DTexturedObject(vaobj);
+glm::mat4 Cuboid::getModelMatrix(){
+  int e = getEntity();
+  glm::mat4 translateCube = glm::translate(glm::vec3(entities.x[e], entities.y[e], entities.z[e]));
+  glm::mat4 rotateCube = glm::rotate((float)(entities.angle[e]*M_PI/180.0f), axis); // rotate about vector (-1,1,1)
+  return translateCube * rotateCube;
+}
+
+/* Slot in the entity store, snapshots are indexed by it */
+int Cuboid::getId(){
+  return handle.index;
+}
+
+/* Render side: position between the last two snapshot states, at alpha */
+glm::vec3 Cuboid::getRenderPosition(float alpha){
+  const CuboidState &now = frontSnapshot->current[handle.index], &before = frontSnapshot->previous[handle.index];
+  glm::vec3 current(now.x, now.y, now.z), previous(before.x, before.y, before.z);
+  // Respawns and resets jump, they are not motion to blend
+  if(glm::length(current - previous) > TELEPORT_DISTANCE)
+    return current;
+  return previous + (current - previous) * alpha;
+}
+
+glm::mat4 Cuboid::getRenderModelMatrix(float alpha){
+  const CuboidState &now = frontSnapshot->current[handle.index], &before = frontSnapshot->previous[handle.index];
+  float renderAngle = now.angle;
+  if(fabs(now.angle - before.angle) < 180.0f)
+    renderAngle = before.angle + (now.angle - before.angle) * alpha;
+  glm::mat4 translateCube = glm::translate(getRenderPosition(alpha));
+  glm::mat4 rotateCube = glm::rotate((float)(renderAngle*M_PI/180.0f), axis);
+  return translateCube * rotateCube;
+}
+
+AABB Cuboid::getRenderBounds(float alpha){
+  return boundsAt(getRenderPosition(alpha), frontSnapshot->current[handle.index].angle);
+}
+
+/* Simulation side, the states of every entity by slot. Free slots are not drawn. */
+void captureStates(vector<CuboidState> &states){
+  states.resize(entities.getSlotCount());
+  for(int i = 0; i < states.size(); i++)
+    states[i].drawn = false;
+  for(int i = 0; i < entities.size(); i++){
+    CuboidState &state = states[entities.slotOf[i]];
+    uint32_t flags = entities.flags[i];
+    state.x = entities.x[i];
+    state.y = entities.y[i];
+    state.z = entities.z[i];
+    state.angle = entities.angle[i];
+    state.visible = (flags & ENTITY_VISIBLE) != 0;
+    state.sliding = (flags & ENTITY_SLIDING) != 0;
+    state.drawn = (flags & (ENTITY_SHOWN | ENTITY_ALIVE)) == (ENTITY_SHOWN | ENTITY_ALIVE);
+  }
+}
+
+/* Call before every simulation tick, so rendering can blend from here */
+void storeSimState(){
+  captureStates(simPrevious);
+}
+
+SnapshotBuffer::SnapshotBuffer(){
+  backIndex = 0;
+  readyIndex = 1;
+  frontIndex = 2;
+  fresh = false;
+  pthread_mutex_init(&mutex, NULL);
+}
+
+/* Simulation side, fill it then publish it */
+WorldSnapshot& SnapshotBuffer::back(){
+  return buffers[backIndex];
+}
+
+void SnapshotBuffer::publish(){
+  pthread_mutex_lock(&mutex);
+  std::swap(backIndex, readyIndex);
+  fresh = true;
+  pthread_mutex_unlock(&mutex);
+}
+
+/* Render side, the latest published snapshot. It stays valid until the next acquire. */
+const WorldSnapshot* SnapshotBuffer::acquire(){
+  pthread_mutex_lock(&mutex);
+  if(fresh){
+    std::swap(frontIndex, readyIndex);
+    fresh = false;
+  }
+  pthread_mutex_unlock(&mutex);
+  return &buffers[frontIndex];
+}
+
+void Cuboid::draw(int objectIndex){
+  // The model matrix was written to the transform buffer at submit time
+  objectTransforms.bind();
+  stateUniform1i("objectIndex", objectIndex);
+  stateUniform1i("texSampler", 0);
+  draw3DTexturedObject(vaobj, textureID);
+}
+
+AABB Cuboid::getBounds(){
+  int e = getEntity();
+  return boundsAt(glm::vec3(entities.x[e], entities.y[e], entities.z[e]), entities.angle[e]);
+}
+
+/* Size never changes, so this is safe from the render side too */
+AABB Cuboid::boundsAt(const glm::vec3 &centre, float angle){
+  AABB box;
+  float halfX = width/2.0f, halfY = height/2.0f, halfZ = length/2.0f;
+  if(angle != 0.0f){
+    // Rotated about Y, bound the footprint by its circumscribed circle
+    halfX = halfZ = sqrt(halfX*halfX + halfZ*halfZ);
+  }
+  box.min = centre - glm::vec3(halfX, halfY, halfZ);
+  box.max = centre + glm::vec3(halfX, halfY, halfZ);
+  return box;
+}
+
+void Cuboid::submit(){
+  // Whether it shows was decided by its entity when the snapshot was taken
+  if(!frontSnapshot->current[handle.index].drawn)return;
+  if(testFrustum(viewFrustum, getRenderBounds(renderAlpha)) == FRUSTUM_OUTSIDE){
+    cullStats.culled++;
+    return;
+  }
+  int objectIndex = objectTransforms.push(getRenderModelMatrix(renderAlpha));
+  if(objectIndex < 0)return; // Out of room this frame, the buffer grows for the next one
+  cullStats.drawn++;
+  // Distance along the view direction, for front to back ordering
+  glm::vec3 position = getRenderPosition(renderAlpha);
+  glm::vec4 viewPos = mtx->view * glm::vec4(position[0], position[1], position[2], 1.0f);
+  uint64_t key = makeRenderKey(PASS_OBJECTS, textureProgramID, textureID, vaobj->VertexArrayID, -viewPos[2]);
+  renderQueue.submit(key, textureProgramID, RENDER_CUBOID, this, objectIndex);
 }
 
 void Cuboid::setAngle(float angle){
-  this->angle = angle;
+  entities.angle[getEntity()] = angle;
 }
 
 float Cuboid::getAngle(){
-  return angle;
+  return entities.angle[getEntity()];
+}
+
+GLuint Cuboid::getTextureID(){
+  return textureID;
 }
 
+/* Sets or clears a flag, bumping the static geometry version when it changes */
+static void setStaticFlag(int entity, uint32_t flag, bool value){
+  uint32_t &flags = entities.flags[entity];
+  if(((flags & flag) != 0) != value)staticGeometryVersion++;
+  if(value)flags |= flag;
+  else flags &= ~flag;
+}
 
 void Cuboid::setVisible(bool value){
-  this->visible = value;
+  setStaticFlag(getEntity(), ENTITY_VISIBLE, value);
 }
 
 
 void Cuboid::setSliding(bool value){
-  this->sliding = value;
+  setStaticFlag(getEntity(), ENTITY_SLIDING, value);
 
 }
 
 void Cuboid::setEmpty(bool value){
-	this->empty = value;
+	setStaticFlag(getEntity(), ENTITY_EMPTY, value);
 }
 
 bool Cuboid::isVisible(){
-  return this->visible;
+  return (entities.flags[getEntity()] & ENTITY_VISIBLE) != 0;
 }
 
 bool Cuboid::isSliding(){
-  return this->sliding;
+  return (entities.flags[getEntity()] & ENTITY_SLIDING) != 0;
 }
 
 bool Cuboid::isEmpty(){
-	return this->empty;
+	return (entities.flags[getEntity()] & ENTITY_EMPTY) != 0;
 }
 
 void Cuboid::setPosition(float x, float y, float z){
-  this->x = x;
-  this->y = y;
-  this->z = z;
+  int e = getEntity();
+  entities.x[e] = x;
+  entities.y[e] = y;
+  entities.z[e] = z;
 }
 
 float Cuboid::getPosX(){
-  return x;
+  return entities.x[getEntity()];
 }
 
 float Cuboid::getPosY(){
-  return y;
+  return entities.y[getEntity()];
 }
 
 float Cuboid::getPosZ(){
-  return z;
+  return entities.z[getEntity()];
 }
 
 float Cuboid::getMinX(){
-  return x - width/2.0f;
+  int e = getEntity();
+  return entities.x[e] - entities.halfX[e];
+}
+
+float Cuboid::getMinY(){
+  int e = getEntity();
+  return entities.y[e] - entities.halfY[e];
+}
+
+float Cuboid::getMinZ(){
+  int e = getEntity();
+  return entities.z[e] - entities.halfZ[e];
+}
+
+float Cuboid::getMaxX(){
+  int e = getEntity();
+  return entities.x[e] + entities.halfX[e];
+}
+
+float Cuboid::getMaxY(){
+  int e = getEntity();
+  return entities.y[e] + entities.halfY[e];
+}
+
+float Cuboid::getMaxZ(){
+  int e = getEntity();
+  return entities.z[e] + entities.halfZ[e];
+}
+
+
+float Cuboid::getWidth(){
+  return width;
+}
+
+float Cuboid::getLength(){
+  return length;
+}
+
+float Cuboid::getHeight(){
+  return height;
+}
+
+bool Cuboid::checkCollision(Cuboid &cb){
+  return entities.overlaps(getEntity(), cb.getEntity());
+}
+
+InstancedBatch::InstancedBatch(GLMatrices *mtx, Cuboid *prototype)
+{
+  this->mtx = mtx;
+  this->textureID = prototype->textureID;
+  this->mesh = prototype->vaobj;
+  this->capacity = 0;
+
+  glGenVertexArrays(1, &VertexArrayID);
+  glGenBuffers(1, &InstanceBuffer);
+  stateBindVertexArray(VertexArrayID);
+
+  // Every member shares the cached mesh, so bind its buffers once here
+  glBindBuffer(GL_ARRAY_BUFFER, mesh->VertexBuffer);
+  glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 0, (void*)0);
+  glEnableVertexAttribArray(0);
+
+  glBindBuffer(GL_ARRAY_BUFFER, mesh->TextureBuffer);
+  glVertexAttribPointer(2, 2, GL_FLOAT, GL_FALSE, 0, (void*)0);
+  glEnableVertexAttribArray(2);
+
+  // attribute 3. Instance offset (x,y,z) and visibility, advanced once per instance
+  glBindBuffer(GL_ARRAY_BUFFER, InstanceBuffer);
+  glVertexAttribPointer(3, 4, GL_FLOAT, GL_FALSE, 0, (void*)0);
+  glEnableVertexAttribArray(3);
+  glVertexAttribDivisor(3, 1);
+
+  if(mesh->NumIndices > 0)
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mesh->IndexBuffer);
+}
+
+InstancedBatch::~InstancedBatch(){
+  glDeleteBuffers(1, &InstanceBuffer);
+  glDeleteVertexArrays(1, &VertexArrayID);
+  invalidateGLState();
+}
+
+bool InstancedBatch::accepts(Cuboid &cbd){
+  return cbd.textureID == textureID && cbd.vaobj == mesh && cbd.getAngle() == 0.0f;
+}
+
+void InstancedBatch::add(Cuboid *cbd){
+  members.push_back(cbd);
+}
+
+void InstancedBatch::updateInstances(){
+  int i, n = members.size();
+  bool changed = false;
+  if(n > capacity){
+    glBindBuffer(GL_ARRAY_BUFFER, InstanceBuffer);
+    glBufferData(GL_ARRAY_BUFFER, 4*n*sizeof(GLfloat), NULL, GL_DYNAMIC_DRAW);
+    instance_buffer_data.assign(4*n, 0.0f);
+    capacity = n;
+    changed = true;
+  }
+  for(i = 0; i < n; i++){
+    GLfloat instance[4];
+    bool visible = frontSnapshot->current[members[i]->getId()].visible;
+    if(visible && testFrustum(viewFrustum, members[i]->getRenderBounds(renderAlpha)) == FRUSTUM_OUTSIDE){
+      cullStats.culled++;
+      visible = false;
+    }
+    else if(visible)cullStats.drawn++;
+    glm::vec3 position = members[i]->getRenderPosition(renderAlpha);
+    instance[0] = position[0];
+    instance[1] = position[1];
+    instance[2] = position[2];
+    instance[3] = visible ? 1.0f : 0.0f;
+    for(int k = 0; k < 4; k++){
+      if(instance_buffer_data[4*i + k] != instance[k]){
+        instance_buffer_data[4*i + k] = instance[k];
+        changed = true;
+      }
+    }
+  }
+  // Sliding tiles move every tick, but nothing is uploaded while they are off screen or still
+  if(changed && n > 0){
+    glBindBuffer(GL_ARRAY_BUFFER, InstanceBuffer);
+    glBufferSubData(GL_ARRAY_BUFFER, 0, 4*n*sizeof(GLfloat), &instance_buffer_data[0]);
+  }
+}
+
+void InstancedBatch::submit(){
+  if(members.empty())return;
+  // Visibility depends on the frustum, so it is resolved at submit time
+  updateInstances();
+  uint64_t key = makeRenderKey(PASS_SCENE, textureInstancedProgramID, textureID, VertexArrayID, 0.0f);
+  renderQueue.submit(key, textureInstancedProgramID, RENDER_INSTANCED_BATCH, this);
+}
+
+void InstancedBatch::draw(){
+  statePolygonMode(GL_FILL);
+  stateBindVertexArray(VertexArrayID);
+  stateBindTexture(0, textureID);
+  stateUniform1i("texSampler", 0);
+  if(mesh->NumIndices > 0)
+    glDrawElementsInstanced(mesh->PrimitiveMode, mesh->NumIndices, mesh->IndexType, (void*)0, members.size());
+  else
+    glDrawArraysInstanced(mesh->PrimitiveMode, 0, mesh->NumVertices, members.size());
+}
+
+BoardMesh::BoardMesh(GLMatrices *mtx, const vector<Cuboid*> &tiles){
+  this->mtx = mtx;
+  this->tiles = tiles;
+  chunkRows = (NUM_TILES_ROW + CHUNK - 1) / CHUNK;
+  chunkCols = (NUM_TILES_COL + CHUNK - 1) / CHUNK;
+  chunks.resize(chunkRows * chunkCols);
+  for(int i = 0; i < chunks.size(); i++){
+    chunks[i].vao = NULL;
+    chunks[i].dirty = true;
+  }
+  solid.assign(NUM_TILES_ROW * NUM_TILES_COL, 0);
+  builtVersion = -1;
+}
+
+BoardMesh::~BoardMesh(){
+  for(int i = 0; i < chunks.size(); i++){
+    VAO *vao = chunks[i].vao;
+    if(vao == NULL)continue;
+    glDeleteBuffers(1, &vao->VertexBuffer);
+    glDeleteBuffers(1, &vao->TextureBuffer);
+    glDeleteBuffers(1, &vao->IndexBuffer);
+    glDeleteVertexArrays(1, &vao->VertexArrayID);
+    delete vao;
+  }
+  invalidateGLState();
+}
+
+/* Outside the board counts as solid, it is water */
+bool BoardMesh::isSolid(int row, int col){
+  if(row < 0 || row >= NUM_TILES_ROW || col < 0 || col >= NUM_TILES_COL)return true;
+  return solid[row * NUM_TILES_COL + col] != 0;
+}
+
+/* Whether the face of a tile can share a quad with the same face of 'tile' */
+bool BoardMesh::merges(int row, int col, Cuboid *tile){
+  if(row < 0 || row >= NUM_TILES_ROW || col < 0 || col >= NUM_TILES_COL || !isSolid(row, col))return false;
+  Cuboid *other = tiles[row * NUM_TILES_COL + col];
+  return other->textureID == tile->textureID && frontSnapshot->current[other->getId()].y == frontSnapshot->current[tile->getId()].y;
+}
+
+/* Render side, from the snapshot: marks the chunks of every tile whose
+   state changed, and of its neighbours, whose sides depend on it */
+void BoardMesh::update(){
+  for(int row = 0; row < NUM_TILES_ROW; row++){
+    for(int col = 0; col < NUM_TILES_COL; col++){
+      const CuboidState &state = frontSnapshot->current[tiles[row * NUM_TILES_COL + col]->getId()];
+      char now = state.visible && !state.sliding;
+      if(solid[row * NUM_TILES_COL + col] == now)continue;
+      solid[row * NUM_TILES_COL + col] = now;
+      static const int around[5][2] = { {0, 0}, {1, 0}, {-1, 0}, {0, 1}, {0, -1} };
+      for(int k = 0; k < 5; k++){
+        int r = row + around[k][0], c = col + around[k][1];
+        if(r < 0 || r >= NUM_TILES_ROW || c < 0 || c >= NUM_TILES_COL)continue;
+        chunks[(r / CHUNK) * chunkCols + c / CHUNK].dirty = true;
+      }
+    }
+  }
+  builtVersion = frontSnapshot->staticVersion;
+}
+
+/* Corners in order around the quad. Untextured faces sample the texture's
+   corner, like the sides of a tile's cuboid mesh. */
+void BoardMesh::addQuad(GLuint textureID, const glm::vec3 corners[4], bool textured){
+  vector<GLfloat> &v = vertices[textureID];
+  vector<GLfloat> &t = uvs[textureID];
+  for(int k = 0; k < 4; k++){
+    v.push_back(corners[k][0]);
+    v.push_back(corners[k][1]);
+    v.push_back(corners[k][2]);
+    // One repeat per tile in world space, so a merged quad looks like the tiles it replaces
+    t.push_back(textured ? corners[k][0] / TILE_WIDTH + 0.5f : 0.0f);
+    t.push_back(textured ? corners[k][2] / TILE_LENGTH + 0.5f : 0.0f);
+  }
+}
+
+/* Greedy meshing: tops grow into the largest rectangles of solid tiles
+   with one texture and height, exposed sides into runs along their edge */
+void BoardMesh::mesh(int index){
+  Chunk &chunk = chunks[index];
+  int firstRow = (index / chunkCols) * CHUNK, firstCol = (index % chunkCols) * CHUNK;
+  int lastRow = min(firstRow + CHUNK, NUM_TILES_ROW), lastCol = min(firstCol + CHUNK, NUM_TILES_COL);
+  int row, col, k;
+
+  vertices.clear();
+  uvs.clear();
+  vector<char> done(CHUNK * CHUNK, 0);
+  for(row = firstRow; row < lastRow; row++){
+    for(col = firstCol; col < lastCol; col++){
+      if(!isSolid(row, col) || done[(row - firstRow) * CHUNK + col - firstCol])continue;
+      Cuboid *tile = tiles[row * NUM_TILES_COL + col];
+      int width = 1, height = 1;
+      while(col + width < lastCol && !done[(row - firstRow) * CHUNK + col + width - firstCol] && merges(row, col + width, tile))
+        width++;
+      bool grows = true;
+      while(grows && row + height < lastRow){
+        for(k = 0; k < width && grows; k++)
+          grows = !done[(row + height - firstRow) * CHUNK + col + k - firstCol] && merges(row + height, col + k, tile);
+        if(grows)height++;
+      }
+      for(int r = 0; r < height; r++)
+        for(k = 0; k < width; k++)
+          done[(row + r - firstRow) * CHUNK + col + k - firstCol] = 1;
+      const CuboidState &state = frontSnapshot->current[tile->getId()];
+      float x0 = state.x - TILE_WIDTH/2.0f, x1 = x0 + width * TILE_WIDTH;
+      float z0 = state.z - TILE_LENGTH/2.0f, z1 = z0 + height * TILE_LENGTH;
+      float top = state.y + TILE_HEIGHT/2.0f;
+      glm::vec3 corners[4] = { glm::vec3(x1, top, z0), glm::vec3(x1, top, z1), glm::vec3(x0, top, z1), glm::vec3(x0, top, z0) };
+      addQuad(tile->textureID, corners, true);
+    }
+  }
+
+  // Sides facing a hole or a sliding tile, in runs, for each of the four directions
+  static const int dirRow[4] = {0, 0, 1, -1}, dirCol[4] = {1, -1, 0, 0};
+  for(int d = 0; d < 4; d++){
+    bool alongZ = dirCol[d] != 0; // X facing sides run from row to row
+    int lineFirst = alongZ ? firstCol : firstRow, lineLast = alongZ ? lastCol : lastRow;
+    int runFirst = alongZ ? firstRow : firstCol, runLast = alongZ ? lastRow : lastCol;
+    for(int line = lineFirst; line < lineLast; line++){
+      int at = runFirst;
+      while(at < runLast){
+        row = alongZ ? at : line;
+        col = alongZ ? line : at;
+        if(!isSolid(row, col) || isSolid(row + dirRow[d], col + dirCol[d])){
+          at++;
+          continue;
+        }
+        Cuboid *tile = tiles[row * NUM_TILES_COL + col];
+        int run = 1;
+        while(at + run < runLast){
+          int r = alongZ ? at + run : line, c = alongZ ? line : at + run;
+          if(!merges(r, c, tile) || isSolid(r + dirRow[d], c + dirCol[d]))break;
+          run++;
+        }
+        const CuboidState &state = frontSnapshot->current[tile->getId()];
+        float y0 = state.y - TILE_HEIGHT/2.0f, y1 = state.y + TILE_HEIGHT/2.0f;
+        glm::vec3 corners[4];
+        if(alongZ){
+          float x = state.x + dirCol[d] * TILE_WIDTH/2.0f;
+          float z0 = state.z - TILE_LENGTH/2.0f, z1 = z0 + run * TILE_LENGTH;
+          corners[0] = glm::vec3(x, y1, z0);
+          corners[1] = glm::vec3(x, y0, z0);
+          corners[2] = glm::vec3(x, y0, z1);
+          corners[3] = glm::vec3(x, y1, z1);
+        }
+        else{
+          float z = state.z + dirRow[d] * TILE_LENGTH/2.0f;
+          float x0 = state.x - TILE_WIDTH/2.0f, x1 = x0 + run * TILE_WIDTH;
+          corners[0] = glm::vec3(x0, y1, z);
+          corners[1] = glm::vec3(x0, y0, z);
+          corners[2] = glm::vec3(x1, y0, z);
+          corners[3] = glm::vec3(x1, y1, z);
+        }
+        addQuad(tile->textureID, corners, false);
+        at += run;
+      }
+    }
+  }
+
+  // One buffer for the chunk, one index range per texture
+  if(chunk.vao != NULL){
+    glDeleteBuffers(1, &chunk.vao->VertexBuffer);
+    glDeleteBuffers(1, &chunk.vao->TextureBuffer);
+    glDeleteBuffers(1, &chunk.vao->IndexBuffer);
+    glDeleteVertexArrays(1, &chunk.vao->VertexArrayID);
+    delete chunk.vao;
+    chunk.vao = NULL;
+  }
+  chunk.ranges.clear();
+  chunk.dirty = false;
+  vector<GLfloat> allVertices, allUVs;
+  vector<GLuint> indices;
+  map<GLuint, vector<GLfloat> >::iterator it;
+  for(it = vertices.begin(); it != vertices.end(); it++){
+    Range range;
+    range.textureID = it->first;
+    range.first = indices.size();
+    GLuint base = allVertices.size() / 3;
+    for(GLuint corner = base; corner < base + it->second.size() / 3; corner += 4){
+      indices.push_back(corner);
+      indices.push_back(corner + 1);
+      indices.push_back(corner + 2);
+      indices.push_back(corner);
+      indices.push_back(corner + 3);
+      indices.push_back(corner + 2);
+    }
+    range.count = indices.size() - range.first;
+    chunk.ranges.push_back(range);
+    allVertices.insert(allVertices.end(), it->second.begin(), it->second.end());
+    allUVs.insert(allUVs.end(), uvs[it->first].begin(), uvs[it->first].end());
+  }
+  if(!indices.empty()){
+    chunk.vao = create3DTexturedObject(GL_TRIANGLES, allVertices.size() / 3, &allVertices[0], &allUVs[0], indices.size(), GL_UNSIGNED_INT, &indices[0], chunk.ranges[0].textureID, GL_FILL);
+    chunk.bounds.min = chunk.bounds.max = glm::vec3(allVertices[0], allVertices[1], allVertices[2]);
+    for(k = 3; k < allVertices.size(); k += 3){
+      for(int axis = 0; axis < 3; axis++){
+        chunk.bounds.min[axis] = min(chunk.bounds.min[axis], allVertices[k + axis]);
+        chunk.bounds.max[axis] = max(chunk.bounds.max[axis], allVertices[k + axis]);
+      }
+    }
+  }
+  invalidateGLState();
+}
+
+/* Meshes again what the snapshot changed */
+void BoardMesh::refresh(){
+  if(builtVersion != frontSnapshot->staticVersion)update();
+  for(int i = 0; i < chunks.size(); i++)
+    if(chunks[i].dirty)mesh(i);
+}
+
+void BoardMesh::submit(){
+  refresh();
+  for(int i = 0; i < chunks.size(); i++){
+    if(chunks[i].vao == NULL)continue;
+    if(testFrustum(viewFrustum, chunks[i].bounds) == FRUSTUM_OUTSIDE){
+      cullStats.culled++;
+      continue;
+    }
+    cullStats.drawn++;
+    uint64_t key = makeRenderKey(PASS_SCENE, textureProgramID, chunks[i].ranges[0].textureID, chunks[i].vao->VertexArrayID, 0.0f);
+    renderQueue.submit(key, textureProgramID, RENDER_BOARD_CHUNK, this, i);
+  }
+}
+
+void BoardMesh::drawChunk(int index){
+  Chunk &chunk = chunks[index];
+  // Geometry is already in world space, so it uses the identity slot
+  objectTransforms.bind();
+  stateUniform1i("objectIndex", 0);
+  stateUniform1i("texSampler", 0);
+  statePolygonMode(GL_FILL);
+  stateBindVertexArray(chunk.vao->VertexArrayID);
+  for(int i = 0; i < chunk.ranges.size(); i++){
+    stateBindTexture(0, chunk.ranges[i].textureID);
+    glDrawElements(chunk.vao->PrimitiveMode, chunk.ranges[i].count, chunk.vao->IndexType, (void*)(chunk.ranges[i].first * sizeof(GLuint)));
+  }
+}
+
+/* Every chunk straight away, bypassing the render queue */
+void BoardMesh::drawAll(){
+  refresh();
+  stateUseProgram(textureProgramID);
+  for(int i = 0; i < chunks.size(); i++)
+    if(chunks[i].vao != NULL)drawChunk(i);
+}
+
+WaterPlane::WaterPlane(GLMatrices *mtx, GLuint textureID1, GLuint textureID2){
+  // Three tiles of water left and right of the board, a board's length of it in front and behind
+  const int firstCol = -3, lastCol = NUM_TILES_COL + 2;
+  const int firstRow = -NUM_TILES_ROW, lastRow = 2*NUM_TILES_ROW - 1;
+  const int columns = lastCol - firstCol + 1, rows = lastRow - firstRow + 1;
+  const float top = TILE_HEIGHT/2.0f;
+  vector<GLfloat> vertices, uvs;
+  vector<GLuint> indices;
+  int row, col;
+
+  this->mtx = mtx;
+  this->textureID1 = textureID1;
+  this->textureID2 = textureID2;
+
+  // Corners are shared between cells, tiles are centred on multiples of their size
+  for(row = 0; row <= rows; row++){
+    for(col = 0; col <= columns; col++){
+      float x = (firstCol + col - 0.5f) * TILE_WIDTH, z = (firstRow + row - 0.5f) * TILE_LENGTH;
+      vertices.push_back(x);
+      vertices.push_back(top);
+      vertices.push_back(z);
+      // One texture repeat per cell, like the water tiles had
+      uvs.push_back(x / TILE_WIDTH);
+      uvs.push_back(z / TILE_LENGTH);
+    }
+  }
+  for(row = 0; row < rows; row++){
+    for(col = 0; col < columns; col++){
+      int boardRow = firstRow + row, boardCol = firstCol + col;
+      if(boardRow >= 0 && boardRow < NUM_TILES_ROW && boardCol >= 0 && boardCol < NUM_TILES_COL)
+        continue; // the board covers it
+      GLuint corner = row * (columns + 1) + col;
+      indices.push_back(corner);
+      indices.push_back(corner + columns + 1);
+      indices.push_back(corner + 1);
+      indices.push_back(corner + 1);
+      indices.push_back(corner + columns + 1);
+      indices.push_back(corner + columns + 2);
+    }
+  }
+  vao = create3DTexturedObject(GL_TRIANGLES, vertices.size() / 3, &vertices[0], &uvs[0], indices.size(), GL_UNSIGNED_INT, &indices[0], textureID1, GL_FILL);
+  invalidateGLState();
+  bounds.min = glm::vec3((firstCol - 0.5f) * TILE_WIDTH, top, (firstRow - 0.5f) * TILE_LENGTH);
+  bounds.max = glm::vec3((lastCol + 0.5f) * TILE_WIDTH, top, (lastRow + 0.5f) * TILE_LENGTH);
+}
+
+WaterPlane::~WaterPlane(){
+  glDeleteBuffers(1, &vao->VertexBuffer);
+  glDeleteBuffers(1, &vao->TextureBuffer);
+  glDeleteBuffers(1, &vao->IndexBuffer);
+  glDeleteVertexArrays(1, &vao->VertexArrayID);
+  delete vao;
+  invalidateGLState();
+}
+
+void WaterPlane::submit(){
+  if(testFrustum(viewFrustum, bounds) == FRUSTUM_OUTSIDE){
+    cullStats.culled++;
+    return;
+  }
+  cullStats.drawn++;
+  uint64_t key = makeRenderKey(PASS_SCENE, waterProgramID, textureID1, vao->VertexArrayID, 0.0f);
+  renderQueue.submit(key, waterProgramID, RENDER_WATER, this);
+}
+
+void WaterPlane::draw(){
+  // Simulated time, so the water stops with the game and headless runs repeat
+  GLfloat time = frontSnapshot->simTime + renderAlpha * frontSnapshot->tickLength;
+  glUniform1f(stateUniformLocation(waterProgramID, "time"), time);
+  stateUniform1i("water1", 0);
+  stateUniform1i("water2", 2); // unit 1 holds the transform buffer
+  statePolygonMode(GL_FILL);
+  stateBindVertexArray(vao->VertexArrayID);
+  stateBindTexture(0, textureID1);
+  stateBindTexture(2, textureID2);
+  glDrawElements(vao->PrimitiveMode, vao->NumIndices, vao->IndexType, (void*)0);
+}
+
+BackgroundCache::BackgroundCache(){
+  framebuffer = 0;
+  width = height = 0;
+  cachedView = -1;
+  cachedVersion = -1;
+  unsupported = false;
+}
+
+void BackgroundCache::resize(int width, int height){
+  if(width == this->width && height == this->height)return;
+  destroy();
+  this->width = width;
+  this->height = height;
+}
+
+void BackgroundCache::create(){
+  glGenTextures(1, &colorTexture);
+  glBindTexture(GL_TEXTURE_2D, colorTexture);
+  glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+  glGenTextures(1, &depthTexture);
+  glBindTexture(GL_TEXTURE_2D, depthTexture);
+  glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT24, width, height, 0, GL_DEPTH_COMPONENT, GL_UNSIGNED_INT, NULL);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+
+  GLint target;
+  glGetIntegerv(GL_FRAMEBUFFER_BINDING, &target);
+  glGenFramebuffers(1, &framebuffer);
+  glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+  glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, colorTexture, 0);
+  glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, depthTexture, 0);
+  bool complete = glCheckFramebufferStatus(GL_FRAMEBUFFER) == GL_FRAMEBUFFER_COMPLETE;
+  glBindFramebuffer(GL_FRAMEBUFFER, target);
+  glGenVertexArrays(1, &emptyVertexArray);
+  invalidateGLState();
+  cachedView = -1;
+  if(!complete){
+    cout << "Background cache: framebuffer incomplete, drawing the board every frame" << endl;
+    destroy();
+    unsupported = true;
+  }
+}
+
+/* Creates the textures if needed, false when the board must be drawn the usual way */
+bool BackgroundCache::prepare(){
+  if(framebuffer == 0 && !unsupported)create();
+  return !unsupported;
+}
+
+void BackgroundCache::destroy(){
+  if(framebuffer == 0)return;
+  glDeleteFramebuffers(1, &framebuffer);
+  glDeleteTextures(1, &colorTexture);
+  glDeleteTextures(1, &depthTexture);
+  glDeleteVertexArrays(1, &emptyVertexArray);
+  invalidateGLState();
+  framebuffer = 0;
+  cachedView = -1;
+}
+
+/* Call after prepare(), with the frame's camera set and the transform buffer ready. Leaves the
+   board in color and depth of the bound framebuffer, headless runs draw
+   into their own, so that one is restored rather than the default. */
+void BackgroundCache::composite(int view, int staticVersion){
+  if(view != cachedView || staticVersion != cachedVersion){
+    GLint target;
+    glGetIntegerv(GL_FRAMEBUFFER_BINDING, &target);
+    glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+    boardMesh->drawAll();
+    glBindFramebuffer(GL_FRAMEBUFFER, target);
+    cachedView = view;
+    cachedVersion = staticVersion;
+  }
+  stateUseProgram(backgroundProgramID);
+  stateBindVertexArray(emptyVertexArray);
+  stateBindTexture(0, colorTexture);
+  stateBindTexture(2, depthTexture);
+  stateUniform1i("cachedColor", 0);
+  stateUniform1i("cachedDepth", 2); // unit 1 holds the transform buffer
+  glDrawArrays(GL_TRIANGLES, 0, 3);
+}
+
+Frustum extractFrustum(const glm::mat4 &m){
+  Frustum frustum;
+  // Rows of the matrix, glm is column major
+  glm::vec4 row[4];
+  for(int i = 0; i < 4; i++)
+    row[i] = glm::vec4(m[0][i], m[1][i], m[2][i], m[3][i]);
+  frustum.planes[0] = row[3] + row[0]; // left
+  frustum.planes[1] = row[3] - row[0]; // right
+  frustum.planes[2] = row[3] + row[1]; // bottom
+  frustum.planes[3] = row[3] - row[1]; // top
+  frustum.planes[4] = row[3] + row[2]; // near
+  frustum.planes[5] = row[3] - row[2]; // far
+  return frustum;
+}
+
+FrustumTest testFrustum(const Frustum &frustum, const AABB &box){
+  FrustumTest result = FRUSTUM_INSIDE;
+  for(int i = 0; i < 6; i++){
+    const glm::vec4 &pl = frustum.planes[i];
+    // Corner furthest along the plane normal, and the one furthest against it
+    float px = pl[0] >= 0 ? box.max[0] : box.min[0];
+    float py = pl[1] >= 0 ? box.max[1] : box.min[1];
+    float pz = pl[2] >= 0 ? box.max[2] : box.min[2];
+    float nx = pl[0] >= 0 ? box.min[0] : box.max[0];
+    float ny = pl[1] >= 0 ? box.min[1] : box.max[1];
+    float nz = pl[2] >= 0 ? box.min[2] : box.max[2];
+    if(pl[0]*px + pl[1]*py + pl[2]*pz + pl[3] < 0)return FRUSTUM_OUTSIDE;
+    if(pl[0]*nx + pl[1]*ny + pl[2]*nz + pl[3] < 0)result = FRUSTUM_INTERSECT;
+  }
+  return result;
+}
+
+uint64_t makeRenderKey(int pass, GLuint program, GLuint texture, GLuint mesh, float depth){
+  const float maxDepth = 500.0f; // far plane
+  if(depth < 0.0f)depth = 0.0f;
+  if(depth > maxDepth)depth = maxDepth;
+  uint64_t quantizedDepth = (uint64_t)(depth / maxDepth * 0xFFFFFF);
+  return ((uint64_t)(pass & 0xF) << 60) |
+         ((uint64_t)(program & 0xFF) << 52) |
+         ((uint64_t)(texture & 0xFFFF) << 36) |
+         ((uint64_t)(mesh & 0xFFF) << 24) |
+         quantizedDepth;
+}
+
+void RenderQueue::clear(){
+  items.clear();
+}
+
+void RenderQueue::submit(uint64_t key, GLuint program, RenderKind kind, void *object, int index){
+  RenderItem item;
+  item.key = key;
+  item.program = program;
+  item.kind = kind;
+  item.object = object;
+  item.index = index;
+  items.push_back(item);
+}
+
+/* LSD radix sort on 8 bit digits, stable, skipping digits where all keys agree */
+void RenderQueue::sort(){
+  int n = items.size();
+  if(n < 2)return;
+  scratch.resize(n);
+  for(int shift = 0; shift < 64; shift += 8){
+    int count[256] = {0};
+    for(int i = 0; i < n; i++)
+      count[(items[i].key >> shift) & 0xFF]++;
+    if(count[(items[0].key >> shift) & 0xFF] == n)continue;
+    int offset = 0;
+    for(int d = 0; d < 256; d++){
+      int c = count[d];
+      count[d] = offset;
+      offset += c;
+    }
+    for(int i = 0; i < n; i++)
+      scratch[count[(items[i].key >> shift) & 0xFF]++] = items[i];
+    items.swap(scratch);
+  }
+}
+
+void RenderQueue::flush(){
+  int pass = -1;
+  for(int i = 0; i < items.size(); i++){
+    RenderItem &item = items[i];
+    // Items are sorted by pass first, so each pass is one contiguous run
+    if((int)(item.key >> 60) != pass){
+      if(pass >= 0)profiler.endPass();
+      pass = item.key >> 60;
+      profiler.beginPass(pass);
+    }
+    stateUseProgram(item.program);
+    switch(item.kind){
+      case RENDER_CUBOID:
+        ((Cuboid*)item.object)->draw(item.index);
+        break;
+      case RENDER_INSTANCED_BATCH:
+        ((InstancedBatch*)item.object)->draw();
+        break;
+      case RENDER_BOARD_CHUNK:
+        ((BoardMesh*)item.object)->drawChunk(item.index);
+        break;
+      case RENDER_WATER:
+        ((WaterPlane*)item.object)->draw();
+        break;
+      case RENDER_FONT:
+        ((TextLabel*)item.object)->draw();
+        break;
+    }
+  }
+  if(pass >= 0)profiler.endPass();
+}
+
+const char *passNames[RENDER_PASSES] = {"scene", "objects", "hud"};
+const char *scopeNames[PROFILE_SCOPES] = {"frame", "update", "submit", "sort", "flush"};
+
+FrameProfiler::FrameProfiler(){
+  initialized = false;
+  overlayVisible = false;
+  frame = -1;
+  activePass = -1;
+  dropped = 0;
+  frameStart = 0.0;
+  for(int i = 0; i < OVERLAY_LINES; i++)
+    overlay[i] = NULL;
+}
+
+void FrameProfiler::init(){
+  glGenQueries(LATENCY * RENDER_PASSES, &queries[0][0]);
+  for(int i = 0; i < LATENCY; i++){
+    slotFrame[i] = -1;
+    for(int j = 0; j < RENDER_PASSES; j++)
+      issued[i][j] = false;
+  }
+  history.resize(HISTORY);
+  for(int i = 0; i < HISTORY; i++)
+    history[i].frame = -1;
+  initialized = true;
+}
+
+ProfileSample& FrameProfiler::sample(int frame){
+  return history[frame % HISTORY];
+}
+
+/* Read the queries of the frame held in a slot, only if the GPU is done with them */
+void FrameProfiler::collect(int slot){
+  if(slotFrame[slot] < 0)return;
+  ProfileSample &s = sample(slotFrame[slot]);
+  bool valid = s.frame == slotFrame[slot];
+  for(int pass = 0; pass < RENDER_PASSES; pass++){
+    s.gpu[pass] = 0.0;
+    if(!issued[slot][pass])continue;
+    issued[slot][pass] = false;
+    GLint available = 0;
+    glGetQueryObjectiv(queries[slot][pass], GL_QUERY_RESULT_AVAILABLE, &available);
+    if(!available){
+      valid = false;
+      continue;
+    }
+    GLuint64 elapsed;
+    glGetQueryObjectui64v(queries[slot][pass], GL_QUERY_RESULT, &elapsed);
+    s.gpu[pass] = elapsed / 1000000.0;
+  }
+  if(!valid)dropped++;
+  s.gpuValid = valid;
+  slotFrame[slot] = -1;
+}
+
+void FrameProfiler::beginFrame(){
+  if(!initialized)return;
+  double now = currentTime();
+  if(frame >= 0)
+    sample(frame).cpu[SCOPE_FRAME] = (now - frameStart) * 1000.0;
+  frameStart = now;
+  frame++;
+  int slot = frame % LATENCY;
+  collect(slot);
+  slotFrame[slot] = frame;
+
+  ProfileSample &s = sample(frame);
+  s.frame = frame;
+  s.gpuValid = false;
+  for(int i = 0; i < PROFILE_SCOPES; i++)
+    s.cpu[i] = 0.0;
+  for(int i = 0; i < RENDER_PASSES; i++)
+    s.gpu[i] = 0.0;
+  if(overlayVisible && frame % 30 == 0)
+    updateOverlay();
+}
+
+void FrameProfiler::beginScope(ProfileScope scope){
+  scopeStart[scope] = currentTime();
+}
+
+/* Scopes add up, a phase may run several times in a frame */
+void FrameProfiler::endScope(ProfileScope scope){
+  if(!initialized || frame < 0)return;
+  sample(frame).cpu[scope] += (currentTime() - scopeStart[scope]) * 1000.0;
+}
+
+/* For work timed elsewhere, like simulation ticks on their own thread */
+void FrameProfiler::addScopeTime(ProfileScope scope, double ms){
+  if(!initialized || frame < 0)return;
+  sample(frame).cpu[scope] += ms;
+}
+
+/* Time elapsed queries cannot nest, passes follow each other */
+void FrameProfiler::beginPass(int pass){
+  if(!initialized || frame < 0 || pass >= RENDER_PASSES)return;
+  int slot = frame % LATENCY;
+  if(issued[slot][pass])return;
+  glBeginQuery(GL_TIME_ELAPSED, queries[slot][pass]);
+  issued[slot][pass] = true;
+  activePass = pass;
+}
+
+void FrameProfiler::endPass(){
+  if(activePass < 0)return;
+  glEndQuery(GL_TIME_ELAPSED);
+  activePass = -1;
+}
+
+void FrameProfiler::createOverlay(GlyphAtlas *atlas){
+  float color[3] = {1.0f, 1.0f, 0.0f};
+  for(int i = 0; i < OVERLAY_LINES; i++)
+    overlay[i] = new TextLabel(&Matrices, atlas, color, 10.0f, 23.0f - 12.0f * i, -30.0f, 0.5f);
+}
+
+void FrameProfiler::toggleOverlay(){
+  overlayVisible = !overlayVisible;
+  if(overlayVisible)
+    updateOverlay();
+}
+
+void FrameProfiler::submitOverlay(){
+  if(!overlayVisible || overlay[0] == NULL)return;
+  for(int i = 0; i < OVERLAY_LINES; i++)
+    renderQueue.submit(makeRenderKey(PASS_HUD, fontProgramID, 0, 0, 0.0f), fontProgramID, RENDER_FONT, overlay[i]);
+}
+
+/* Averages of the last 30 complete frames, in ms */
+void FrameProfiler::updateOverlay(){
+  if(overlay[0] == NULL)return;
+  double cpu[PROFILE_SCOPES] = {0}, gpu[RENDER_PASSES] = {0};
+  int cpuFrames = 0, gpuFrames = 0;
+  for(int f = frame - 1; f >= 0 && f >= frame - 30; f--){
+    ProfileSample &s = sample(f);
+    if(s.frame != f)continue;
+    for(int i = 0; i < PROFILE_SCOPES; i++)cpu[i] += s.cpu[i];
+    cpuFrames++;
+    if(!s.gpuValid)continue;
+    for(int i = 0; i < RENDER_PASSES; i++)gpu[i] += s.gpu[i];
+    gpuFrames++;
+  }
+  if(cpuFrames > 0)
+    for(int i = 0; i < PROFILE_SCOPES; i++)cpu[i] /= cpuFrames;
+  if(gpuFrames > 0)
+    for(int i = 0; i < RENDER_PASSES; i++)gpu[i] /= gpuFrames;
+
+  char line[TextLabel::MAX_LENGTH + 1];
+  sprintf(line, "frame %.2f ms  update %.2f", cpu[SCOPE_FRAME], cpu[SCOPE_UPDATE]);
+  overlay[0]->setText(line);
+  sprintf(line, "cpu submit %.2f sort %.2f flush %.2f", cpu[SCOPE_SUBMIT], cpu[SCOPE_SORT], cpu[SCOPE_FLUSH]);
+  overlay[1]->setText(line);
+  sprintf(line, "gpu scene %.2f objects %.2f hud %.2f", gpu[PASS_SCENE], gpu[PASS_OBJECTS], gpu[PASS_HUD]);
+  overlay[2]->setText(line);
+  sprintf(line, "gpu samples dropped %d", dropped);
+  overlay[3]->setText(line);
+}
+
+/* Writes the kept frames as JSON when the name ends in .json, CSV otherwise.
+   GPU columns are empty (null) for frames whose queries were not ready. */
+bool FrameProfiler::dump(const char *filename){
+  if(!initialized)return false;
+  FILE *out = fopen(filename, "w");
+  if(out == NULL){
+    cout << "Could not write profile " << filename << endl;
+    return false;
+  }
+  size_t length = strlen(filename);
+  bool json = length >= 5 && strcmp(filename + length - 5, ".json") == 0;
+  int i;
+  if(json)
+    fprintf(out, "{\n  \"gpuSamplesDropped\": %d,\n  \"frames\": [", dropped);
+  else{
+    fprintf(out, "frame");
+    for(i = 0; i < PROFILE_SCOPES; i++)fprintf(out, ",cpu_%s_ms", scopeNames[i]);
+    for(i = 0; i < RENDER_PASSES; i++)fprintf(out, ",gpu_%s_ms", passNames[i]);
+    fprintf(out, "\n");
+  }
+  bool first = true;
+  // The current frame is still open, stop before it
+  for(int f = max(0, frame - HISTORY + 1); f < frame; f++){
+    ProfileSample &s = sample(f);
+    if(s.frame != f)continue;
+    if(json){
+      fprintf(out, "%s\n    {\"frame\": %d, \"cpu\": {", first ? "" : ",", f);
+      for(i = 0; i < PROFILE_SCOPES; i++)
+        fprintf(out, "%s\"%s\": %.4f", i ? ", " : "", scopeNames[i], s.cpu[i]);
+      fprintf(out, "}, \"gpu\": ");
+      if(s.gpuValid){
+        fprintf(out, "{");
+        for(i = 0; i < RENDER_PASSES; i++)
+          fprintf(out, "%s\"%s\": %.4f", i ? ", " : "", passNames[i], s.gpu[i]);
+        fprintf(out, "}}");
+      }
+      else
+        fprintf(out, "null}");
+    }
+    else{
+      fprintf(out, "%d", f);
+      for(i = 0; i < PROFILE_SCOPES; i++)fprintf(out, ",%.4f", s.cpu[i]);
+      for(i = 0; i < RENDER_PASSES; i++){
+        if(s.gpuValid)fprintf(out, ",%.4f", s.gpu[i]);
+        else fprintf(out, ",");
+      }
+      fprintf(out, "\n");
+    }
+    first = false;
+  }
+  if(json)
+    fprintf(out, "\n  ]\n}\n");
+  fclose(out);
+  cout << "Profile written to " << filename << endl;
+  return true;
+}
+
+TransformBuffer::TransformBuffer(){
+  capacity = maxCapacity = 0;
+  region = count = peak = 0;
+  mapped = NULL;
+  for(int i = 0; i < REGIONS; i++){
+    buffers[i] = textures[i] = 0;
+    fences[i] = 0;
+    persistent[i] = NULL;
+  }
+}
+
+void TransformBuffer::create(int capacity){
+  GLint maxTexels;
+  glGetIntegerv(GL_MAX_TEXTURE_BUFFER_SIZE, &maxTexels);
+  maxCapacity = maxTexels / 4;
+  if(capacity > maxCapacity)capacity = maxCapacity;
+  this->capacity = capacity;
+  GLsizeiptr size = capacity * sizeof(glm::mat4);
+  glGenBuffers(REGIONS, buffers);
+  glGenTextures(REGIONS, textures);
+  for(int i = 0; i < REGIONS; i++){
+    glBindBuffer(GL_TEXTURE_BUFFER, buffers[i]);
+    if(GLAD_GL_ARB_buffer_storage){
+      GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+      glBufferStorage(GL_TEXTURE_BUFFER, size, NULL, flags);
+      persistent[i] = (GLfloat*)glMapBufferRange(GL_TEXTURE_BUFFER, 0, size, flags);
+    }
+    else{
+      glBufferData(GL_TEXTURE_BUFFER, size, NULL, GL_STREAM_DRAW);
+      persistent[i] = NULL;
+    }
+    stateBindTexture(TEXTURE_UNIT, textures[i], GL_TEXTURE_BUFFER);
+    glTexBuffer(GL_TEXTURE_BUFFER, GL_RGBA32F, buffers[i]);
+    fences[i] = 0;
+  }
+  region = count = peak = 0;
+  mapped = NULL;
+}
+
+void TransformBuffer::destroy(){
+  for(int i = 0; i < REGIONS; i++){
+    waitRegion(i);
+    persistent[i] = NULL;
+  }
+  // Deleting a mapped buffer unmaps it
+  glDeleteTextures(REGIONS, textures);
+  glDeleteBuffers(REGIONS, buffers);
+  mapped = NULL;
+  invalidateGLState();
+}
+
+void TransformBuffer::waitRegion(int index){
+  if(fences[index] == 0)return;
+  while(glClientWaitSync(fences[index], GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000) == GL_TIMEOUT_EXPIRED);
+  glDeleteSync(fences[index]);
+  fences[index] = 0;
+}
+
+void TransformBuffer::beginFrame(){
+  // Last frame did not fit, grow before handing out slots
+  if(peak > capacity && capacity < maxCapacity){
+    int needed = capacity;
+    while(needed < peak)needed *= 2;
+    destroy();
+    create(needed);
+  }
+  region = (region + 1) % REGIONS;
+  waitRegion(region);
+  if(persistent[region] != NULL)
+    mapped = persistent[region];
+  else{
+    glBindBuffer(GL_TEXTURE_BUFFER, buffers[region]);
+    mapped = (GLfloat*)glMapBufferRange(GL_TEXTURE_BUFFER, 0, capacity * sizeof(glm::mat4),
+                                        GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT | GL_MAP_UNSYNCHRONIZED_BIT);
+  }
+  count = peak = 0;
+  push(glm::mat4(1.0f));
+}
+
+/* Returns the slot of the matrix, or -1 when this frame's region is full */
+int TransformBuffer::push(const glm::mat4 &model){
+  peak++;
+  if(mapped == NULL || count >= capacity)return -1;
+  memcpy(mapped + 16*count, &model[0][0], 16*sizeof(GLfloat));
+  return count++;
+}
+
+/* Call after the last push and before the draws */
+void TransformBuffer::endFrame(){
+  if(mapped != NULL && persistent[region] == NULL){
+    glBindBuffer(GL_TEXTURE_BUFFER, buffers[region]);
+    glUnmapBuffer(GL_TEXTURE_BUFFER);
+  }
+  mapped = NULL;
 }
 
-float Cuboid::getMinY(){
-  return y - height/2.0f;
+/* Call after the draws, the region is reused once the GPU passed this point */
+void TransformBuffer::fenceFrame(){
+  fences[region] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
 }
 
-float Cuboid::getMinZ(){
-  return z - length/2.0f;
+void TransformBuffer::bind(){
+  stateBindTexture(TEXTURE_UNIT, textures[region], GL_TEXTURE_BUFFER);
+  stateUniform1i("objectTransforms", TEXTURE_UNIT);
 }
 
-float Cuboid::getMaxX(){
-  return x + width/2.0f;
+int TransformBuffer::getCount(){
+  return count;
 }
 
-float Cuboid::getMaxY(){
-  return y + height/2.0f;
+/* Group cuboids into instanced batches by texture and geometry */
+void buildInstancedBatches(GLMatrices *mtx, vector<Cuboid*> &list){
+  for(int i = 0; i < list.size(); i++){
+    InstancedBatch *batch = NULL;
+    for(int j = 0; j < sceneBatches.size(); j++){
+      if(sceneBatches[j]->accepts(*list[i])){
+        batch = sceneBatches[j];
+        break;
+      }
+    }
+    if(batch == NULL){
+      batch = new InstancedBatch(mtx, list[i]);
+      sceneBatches.push_back(batch);
+    }
+    batch->add(list[i]);
+  }
 }
 
-float Cuboid::getMaxZ(){
-  return z + length/2.0f;
-}
+GlyphAtlas::GlyphAtlas(const char *fontfile, int pixelSize){
+	FT_Library library;
+	FT_Face face;
+	FT_Error error = FT_Init_FreeType(&library);
+	const PackEntry *fontEntry = assetPack.find(fontfile, PACK_FONT);
+	if(!error){
+		if(fontEntry != NULL) // FreeType reads straight from the mapped pack
+			error = FT_New_Memory_Face(library, (const FT_Byte*)assetPack.data(fontEntry), fontEntry->size, 0, &face);
+		else
+			error = FT_New_Face(library, fontfile, 0, &face);
+	}
+	if(error || FT_Set_Pixel_Sizes(face, 0, pixelSize))
+	{
+		cout << "Error: Could not load font `" << fontfile << "'" << endl;
+		glfwTerminate();
+		exit(EXIT_FAILURE);
+	}
 
+	// Rasterize every glyph and pack them in rows, 1 pixel apart
+	const int count = LAST_CHAR - FIRST_CHAR + 1;
+	const int atlasWidth = 256;
+	vector< vector<unsigned char> > bitmaps(count);
+	vector<int> penX(count), penY(count);
+	int rowX = 1, rowY = 1, rowHeight = 0;
+	for(int i = 0; i < count; i++){
+		Glyph &glyph = glyphs[i];
+		if(FT_Load_Char(face, FIRST_CHAR + i, FT_LOAD_RENDER)){
+			memset(&glyph, 0, sizeof(glyph));
+			continue;
+		}
+		FT_GlyphSlot slot = face->glyph;
+		glyph.width = slot->bitmap.width;
+		glyph.height = slot->bitmap.rows;
+		glyph.bearingX = slot->bitmap_left;
+		glyph.bearingY = slot->bitmap_top;
+		glyph.advance = slot->advance.x >> 6;
+		bitmaps[i].resize(glyph.width * glyph.height);
+		for(int row = 0; row < glyph.height; row++)
+			memcpy(&bitmaps[i][row * glyph.width], slot->bitmap.buffer + row * slot->bitmap.pitch, glyph.width);
+		if(rowX + glyph.width + 1 > atlasWidth){
+			rowX = 1;
+			rowY += rowHeight + 1;
+			rowHeight = 0;
+		}
+		penX[i] = rowX;
+		penY[i] = rowY;
+		rowX += glyph.width + 1;
+		rowHeight = max(rowHeight, glyph.height);
+	}
+	FT_Done_Face(face);
+	FT_Done_FreeType(library);
+
+	int atlasHeight = 1;
+	while(atlasHeight < rowY + rowHeight + 1)
+		atlasHeight *= 2;
+	vector<unsigned char> pixels(atlasWidth * atlasHeight, 0);
+	for(int i = 0; i < count; i++){
+		Glyph &glyph = glyphs[i];
+		for(int row = 0; row < glyph.height; row++)
+			memcpy(&pixels[(penY[i] + row) * atlasWidth + penX[i]], &bitmaps[i][row * glyph.width], glyph.width);
+		glyph.u0 = (float)penX[i] / atlasWidth;
+		glyph.v0 = (float)penY[i] / atlasHeight;
+		glyph.u1 = (float)(penX[i] + glyph.width) / atlasWidth;
+		glyph.v1 = (float)(penY[i] + glyph.height) / atlasHeight;
+	}
 
-float Cuboid::getWidth(){
-  return width;
+	glGenTextures(1, &textureID);
+	stateBindTexture(0, textureID);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_R8, atlasWidth, atlasHeight, 0, GL_RED, GL_UNSIGNED_BYTE, &pixels[0]);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+	stateBindTexture(0, 0);
 }
 
-float Cuboid::getLength(){
-  return length;
+GlyphAtlas::~GlyphAtlas(){
+	glDeleteTextures(1, &textureID);
+	invalidateGLState();
 }
 
-float Cuboid::getHeight(){
-  return height;
+/* Characters outside the atlas are drawn as a space */
+const GlyphAtlas::Glyph& GlyphAtlas::getGlyph(char c){
+	if(c < FIRST_CHAR || c > LAST_CHAR)
+		c = ' ';
+	return glyphs[c - FIRST_CHAR];
 }
 
-bool Cuboid::checkCollision(Cuboid &cb){
-  if(getMinX() <= cb.getMaxX() && getMaxX() >= cb.getMinX() &&
-     getMinY() <= cb.getMaxY() && getMaxY() >= cb.getMinY() &&
-     getMinZ() <= cb.getMaxZ() && getMaxZ() >= cb.getMinZ()
-    )return true;
-  else return false;
+GLuint GlyphAtlas::getTextureID(){
+	return textureID;
 }
 
-FTGLFont::FTGLFont(GLMatrices *mtx, float* color, char* fontfile, char* word,float size, float x, float y, float z, float scaleFactor)
+TextLabel::TextLabel(GLMatrices *mtx, GlyphAtlas *atlas, float* color, float x, float y, float z, float scaleFactor)
 {
-	cout<<"Entered ftgl"<<endl;
 	this->mtx = mtx;
-	cout<<"mtx made"<<endl;
+	this->atlas = atlas;
 	fontColor = glm::vec3(color[0], color[1], color[2]);
-	cout<<"vec color made"<<endl;
-	this->fontfile = new char[20];
-	strcpy(this->fontfile, fontfile);
-	this->word = new char[100];
-	strcpy(this->word, word);
-	cout<<"str copied"<<endl;
 	this->x = x;
 	this->y = y;
 	this->z = z;
 	this->scaleFactor = scaleFactor;
-	
-	cout<<" Above this->font"<<endl;
-	this->font = new FTExtrudeFont(fontfile); // 3D extrude style rendering
-	if(this->font->Error())
-	{
-		cout << "Error: Could not load font `" << fontfile << "'" << endl;
-		glfwTerminate();
-		exit(EXIT_FAILURE);
-	}
+	text[0] = '\0';
+	capacity = 0;
+	numVertices = 0;
 
-	// Create and compile our GLSL program from the font shaders
-	
 	this->fontMatrixID = glGetUniformLocation(fontProgramID, "MVP");
 	this->fontColorID = glGetUniformLocation(fontProgramID, "fontColor");
 
-	this->font->ShaderLocations(fontVertexCoordAttrib, fontVertexNormalAttrib, fontVertexOffsetUniform);
-	this->font->FaceSize(size);
-	this->font->Depth(0);
-	this->font->Outset(0, 0);
-	this->font->CharMap(ft_encoding_unicode);
+	glGenVertexArrays(1, &VertexArrayID);
+	glGenBuffers(1, &VertexBuffer);
+	stateBindVertexArray(VertexArrayID);
+	glBindBuffer(GL_ARRAY_BUFFER, VertexBuffer);
+	// Interleaved x, y, u, v
+	glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 4*sizeof(GLfloat), (void*)0);
+	glEnableVertexAttribArray(0);
+	glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, 4*sizeof(GLfloat), (void*)(2*sizeof(GLfloat)));
+	glEnableVertexAttribArray(1);
+}
+
+TextLabel::~TextLabel(){
+	glDeleteBuffers(1, &VertexBuffer);
+	glDeleteVertexArrays(1, &VertexArrayID);
+	invalidateGLState();
+}
+
+void TextLabel::setText(const char* text){
+	if(strncmp(this->text, text, MAX_LENGTH) == 0)return;
+	strncpy(this->text, text, MAX_LENGTH);
+	this->text[MAX_LENGTH] = '\0';
+	layout();
+}
+
+/* Two triangles per visible glyph, the pen starts at the origin on the baseline */
+void TextLabel::layout(){
+	int length = strlen(text);
+	vertices.resize(length * 6 * 4);
+	numVertices = 0;
+	float pen = 0.0f;
+	for(int i = 0; i < length; i++){
+		const GlyphAtlas::Glyph &glyph = atlas->getGlyph(text[i]);
+		if(glyph.width > 0 && glyph.height > 0){
+			float x0 = pen + glyph.bearingX, x1 = x0 + glyph.width;
+			float y1 = glyph.bearingY, y0 = y1 - glyph.height;
+			// Atlas rows run top down, so v0 is the top edge of the glyph
+			GLfloat quad[6][4] = {
+				{x0, y0, glyph.u0, glyph.v1}, {x1, y0, glyph.u1, glyph.v1}, {x1, y1, glyph.u1, glyph.v0},
+				{x0, y0, glyph.u0, glyph.v1}, {x1, y1, glyph.u1, glyph.v0}, {x0, y1, glyph.u0, glyph.v0}
+			};
+			memcpy(&vertices[numVertices * 4], quad, sizeof(quad));
+			numVertices += 6;
+		}
+		pen += glyph.advance;
+	}
+	if(numVertices == 0)return;
+	glBindBuffer(GL_ARRAY_BUFFER, VertexBuffer);
+	if(length > capacity){
+		capacity = length;
+		glBufferData(GL_ARRAY_BUFFER, capacity * 6 * 4 * sizeof(GLfloat), NULL, GL_DYNAMIC_DRAW);
+	}
+	glBufferSubData(GL_ARRAY_BUFFER, 0, numVertices * 4 * sizeof(GLfloat), &vertices[0]);
 }
 
-void FTGLFont::draw(){
+void TextLabel::draw(){
+  if(numVertices == 0)return;
   glm::mat4 MVP;
 
-  Matrices.view = glm::lookAt(glm::vec3(0,25,25), glm::vec3(25,2,2), glm::vec3(0,1,0)); // Fixed camera for 2D (ortho) in XY plane
+  // Text has its own fixed camera, the scene camera in Matrices is left alone
+  glm::mat4 view = glm::lookAt(glm::vec3(0,25,25), glm::vec3(25,2,2), glm::vec3(0,1,0));
 	// Transform the text
-	Matrices.model = glm::mat4(1.0f);
 	glm::mat4 translateText = glm::translate(glm::vec3(x,y,z));
 	glm::mat4 scaleText = glm::scale(glm::vec3(scaleFactor,scaleFactor,scaleFactor));
-	Matrices.model *= (translateText * scaleText);
-	MVP = Matrices.projection * Matrices.view * Matrices.model;
+	glm::mat4 model = translateText * scaleText;
+	MVP = mtx->projection * view * model;
 	// send font's MVP and font color to fond shaders
 	glUniformMatrix4fv(this->fontMatrixID, 1, GL_FALSE, &MVP[0][0]);
 	glUniform3fv(this->fontColorID, 1, &fontColor[0]); 
-
-	// Render font
-	this->font->Render(word);
-}
-
-void FTGLFont::setWord(char* word){
-	strcpy(this->word, word);
+	stateUniform1i("atlas", 0);
+
+	// Render the whole string in one draw
+	statePolygonMode(GL_FILL);
+	stateBindVertexArray(VertexArrayID);
+	stateBindTexture(0, atlas->getTextureID());
+	glEnable(GL_BLEND);
+	glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+	glDrawArrays(GL_TRIANGLES, 0, numVertices);
+	glDisable(GL_BLEND);
 }
 
 Player::Player(GLMatrices *mtx, float x, float y, float z){
@@ -1116,7 +3772,7 @@ Player::Player(GLMatrices *mtx, float x, float y, float z){
   colorCube[0] = 0;
   colorCube[1] = 1;//0.412;
   colorCube[2] = 1;//0.270;
-  GLuint textureId = createTexture("box.png");
+  GLuint textureId = acquireTexture("box.png");
   this->score = 0;
   this->life = 3;
   // check for an error during the load process
@@ -1124,6 +3780,7 @@ Player::Player(GLMatrices *mtx, float x, float y, float z){
     cout << "SOIL loading error: '" << SOIL_last_result() << "'" << endl;
   cb = new Cuboid(mtx, textureId, colorCube, x, y, z, 4.0f, 4.0f, 4.0f, 1);
   barrel = new Cuboid(mtx, textureId, colorCube, x , y, z , 1.0f, 7.0f, 1.0f, 1);
+  entities.setDynamic(cb->getEntity());
   groundY = y;
   speedX = 1.0f;
   speedY = 6.0f;
@@ -1145,6 +3802,12 @@ Player::Player(GLMatrices *mtx, float x, float y, float z){
 
 }
 
+Player::~Player(){
+  releaseTexture(cb->getTextureID());
+  delete cb;
+  delete barrel;
+}
+
 void Player::jump(){
   if(!inAir){
     inAir = true;
@@ -1152,9 +3815,9 @@ void Player::jump(){
   }
 }
   
-void Player::draw(){
-  cb->draw();
-  barrel->draw();
+void Player::submit(){
+  cb->submit();
+  barrel->submit();
 }
 
 void Player::setPosition(float x, float y, float z){
@@ -1171,6 +3834,11 @@ float Player::getHeadY(){
 	return headY;
 }
 
+/* Render side, where the body is drawn, for the cameras that follow it */
+glm::vec3 Player::getRenderPosition(float alpha){
+	return cb->getRenderPosition(alpha);
+}
+
 char Player::getLastKey(){
 	return lastKey;
 }
@@ -1204,6 +3872,20 @@ int Player::getScore(){
   return score;
 }
 
+/* Whether the body touched 'tile' anywhere on its way from height fromY
+   to where it is now, not only at the end. A fall or jump can move it
+   further in one tick than a tile is high. */
+bool Player::sweptOntoTile(float fromY, Cuboid *tile){
+  float start[6], target[6], t;
+  int body = cb->getEntity();
+  float dy = entities.y[body] - fromY;
+  entities.boundsOf(body, start);
+  start[1] -= dy;
+  start[4] -= dy;
+  entities.boundsOf(tile->getEntity(), target);
+  return sweepBox(start, 0.0f, dy, 0.0f, target, t);
+}
+
 int Player::getStandingTileIndex(){
   float tx = getPosX();
   float ty = getPosY();
@@ -1305,11 +3987,12 @@ void Player::applyForces(float timeInstance){
   	//cout<<"Entered in air"<<endl;
     jumpTime += timeInstance;
     //cout<<" ** -- ty = "<<ty<<" airSpeed* t = "<<speedY<<" 0.5at^2 = "<<(0.5 * GRAVITY * jumpTime *jumpTime)<<endl;
+    float fromY = getPosY();
     ty += speedY * jumpTime - (0.5 * GRAVITY * jumpTime *jumpTime);
     //cout<<"jumpTime = "<<jumpTime<<"  ** ++ ty = "<<ty<<endl;
     setPosition(tx, ty, tz);
     //Segmentation fault will take place for index = -1, rectify afterwards
-    if(p->cb->checkCollision(*tilesList[tileIndex])){
+    if(sweptOntoTile(fromY, tilesList[tileIndex])){
 
 
       //ty = groundY;
@@ -1346,6 +4029,7 @@ void Player::applyForces(float timeInstance){
 	  		falling = false;
 	  	}
 	  	fallTime += timeInstance;
+	  	float fromY = getPosY();
 	  	ty -= (0.5 * GRAVITY * fallTime * fallTime);
 	  	setPosition(tx, ty, tz);
 	  	//cout<<" Fall time = "<< fallTime<<endl;
@@ -1364,7 +4048,7 @@ void Player::applyForces(float timeInstance){
 	  			looseFlag = true;
 	  		finalFallY = initFallY = 0.0f;
 	  	}
-		else if(tileIndex != -1 && p->cb->checkCollision(*tilesList[tileIndex]) && tilesList[tileIndex]->isSliding() ){
+		else if(tileIndex != -1 && sweptOntoTile(fromY, tilesList[tileIndex]) && tilesList[tileIndex]->isSliding() ){
 			ty = tilesList[tileIndex]->getPosY() + tilesList[tileIndex]->getHeight()/2.0f + cb->getHeight()/2.0f;
 			onSlider = true;
 			sliderTile = tilesList[tileIndex];
@@ -1492,61 +4176,36 @@ Villain::Villain(GLMatrices *mtx, float x, float y, float z, bool dynamic){
   colorCube[0] = 0;
   colorCube[1] = 1;//0.412;
   colorCube[2] = 1;//0.270;
-  GLuint textureId = createTexture("oandb.png");
+  GLuint textureId = acquireTexture("oandb.png");
   // check for an error during the load process
   if(textureId == 0 )
     cout << "SOIL loading error: '" << SOIL_last_result() << "'" << endl;
   cb = new Cuboid(mtx, textureId, colorCube, x, y, z, 2.0f, 2.0f, 2.0f, 1);
   delete[] colorCube;
-  this->dynamic = dynamic;
-  this->visible = true;
-  this->time = 0.0f;
-  this->switchTime = 0.0f;
-  this->speed = 5.0f;
-  this->alive = true;
+  int e = cb->getEntity();
+  entities.flags[e] |= ENTITY_VILLAIN | (dynamic ? ENTITY_PATROLS : 0);
+  entities.velX[e] = 5.0f;
+  entities.setDynamic(e);
+}
+
+Villain::~Villain(){
+  releaseTexture(cb->getTextureID());
+  delete cb;
 }
 
 void Villain::setAlive(bool value){
-	alive = value;
-	visible = false;
+	uint32_t &flags = entities.flags[cb->getEntity()];
+	if(value)flags |= ENTITY_ALIVE;
+	else flags &= ~ENTITY_ALIVE;
+	flags &= ~ENTITY_SHOWN;
 }
 
 bool Villain::getAlive(){
-	return alive;
-}
-
-void Villain::applyForces(float timeInstance){
-	float tx = cb->getPosX();
-	float ty = cb->getPosY();
-	float tz = cb->getPosZ();
-	if(alive){
-		if(dynamic){
-			time += timeInstance;
-			//cout<<"Time - "<<time<<endl;
-			switchTime += timeInstance;
-			if(time >= 15.0f)
-			{
-				//cout<<"Switched visibility "<<endl;
-				visible = !visible;
-				time = 0.0f;
-			}
-			if(switchTime >= 5.0f){
-				speed *= -1.0f;
-				switchTime = 0.0f;
-			}
-			
-			tx += speed*timeInstance;
-			cb->setPosition(tx,ty,tz);
-		}
-
-	}
-	
+	return (entities.flags[cb->getEntity()] & ENTITY_ALIVE) != 0;
 }
 
-void Villain::draw(){
-  if(getVisible() && alive){
-  	  cb->draw();
-  }
+void Villain::submit(){
+  cb->submit();
 }
 
 float Villain::getPosX(){
@@ -1554,7 +4213,7 @@ float Villain::getPosX(){
 }
 
 bool Villain::getVisible(){
-	return visible;
+	return (entities.flags[cb->getEntity()] & ENTITY_SHOWN) != 0;
 }
 
 float Villain::getPosY(){
@@ -1567,21 +4226,25 @@ float Villain::getPosZ(){
 
 Bonus::Bonus(GLMatrices *mtx, float x, float y, float z){
   float *colorCube = new float[3];
-  visible = true;
   colorCube[0] = 0;
   colorCube[1] = 1;//0.412;
   colorCube[2] = 1;//0.270;
-  GLuint textureId = createTexture("gold.png");
+  GLuint textureId = acquireTexture("gold.png");
   // check for an error during the load process
   if(textureId == 0 )
     cout << "SOIL loading error: '" << SOIL_last_result() << "'" << endl;
   cb = new Cuboid(mtx, textureId, colorCube, x, y, z, 2.0f, 2.0f, 2.0f, 1);
   delete[] colorCube;
+  entities.flags[cb->getEntity()] |= ENTITY_BONUS;
+}
+
+Bonus::~Bonus(){
+  releaseTexture(cb->getTextureID());
+  delete cb;
 }
 
-void Bonus::draw(){
-  if(visible)
-    cb->draw();
+void Bonus::submit(){
+  cb->submit();
 }
 
 float Bonus::getPosX(){
@@ -1597,11 +4260,13 @@ float Bonus::getPosZ(){
 }
 
 bool Bonus::isVisible(){
-  return visible;
+  return (entities.flags[cb->getEntity()] & ENTITY_SHOWN) != 0;
 }
 
 void Bonus::setVisible(bool value){
-  this->visible = value;
+  uint32_t &flags = entities.flags[cb->getEntity()];
+  if(value)flags |= ENTITY_SHOWN;
+  else flags &= ~ENTITY_SHOWN;
 }
 
 Bullet::Bullet(GLMatrices *mtx, float x, float y, float z, float ux, float uz){
@@ -1609,37 +4274,42 @@ Bullet::Bullet(GLMatrices *mtx, float x, float y, float z, float ux, float uz){
   colorCube[0] = 0;
   colorCube[1] = 1;//0.412;
   colorCube[2] = 1;//0.270;
-  this->ux = ux;
-  this->uz = uz;
-  GLuint textureId = createTexture("lava.png");
+  GLuint textureId = acquireTexture("lava.png");
   // check for an error during the load process
   if(textureId == 0 )
     cout << "SOIL loading error: '" << SOIL_last_result() << "'" << endl;
   cb = new Cuboid(mtx, textureId, colorCube, x, y, z, 1.0f, 1.5f, 1.0f, 1);
   speed = 10.0f;
-  visible = false;
+  int e = cb->getEntity();
+  entities.flags[e] = (entities.flags[e] & ~ENTITY_SHOWN) | ENTITY_PROJECTILE;
+  entities.velX[e] = ux;
+  entities.velZ[e] = uz;
+  inFlight = false;
   delete[] colorCube;
 }
 
+Bullet::~Bullet(){
+  releaseTexture(cb->getTextureID());
+  delete cb;
+}
+
 void Bullet::applyForces(float timeInstance){
-	float  tx = cb->getPosX();
-	float ty = cb->getPosY();
-	float tz = cb->getPosZ();
+	int e = cb->getEntity();
 	float angle = p->getAngle() + 90.0f;
-	uz = speed * cos(angle * M_PI/180.0f);
-	ux = speed * sin(angle * M_PI/180.0f);
-	if(visible){
-		tx += timeInstance * ux;
-		tz += timeInstance * uz;
-		cb->setPosition(tx, ty, tz);
-		if(abs(tx) > 200.0f || abs(tz) > 200.0f)
-			visible = false;
+	entities.velZ[e] = speed * cos(angle * M_PI/180.0f);
+	entities.velX[e] = speed * sin(angle * M_PI/180.0f);
+	inFlight = (entities.flags[e] & ENTITY_SHOWN) != 0;
+	from = glm::vec3(entities.x[e], entities.y[e], entities.z[e]);
+	if(inFlight){
+		entities.x[e] += timeInstance * entities.velX[e];
+		entities.z[e] += timeInstance * entities.velZ[e];
+		if(abs(entities.x[e]) > 200.0f || abs(entities.z[e]) > 200.0f)
+			entities.flags[e] &= ~ENTITY_SHOWN;
 	}
 }
 
-void Bullet::draw(){
-	if(visible)
-		cb->draw();
+void Bullet::submit(){
+	cb->submit();
 }
 
 void Bullet::fire(){
@@ -1647,17 +4317,13 @@ void Bullet::fire(){
 	float ty = p->getPosY();
 	float tz = p->getPosZ();
 	cb->setPosition(tx, ty, tz);
-	visible = true;
+	entities.flags[cb->getEntity()] |= ENTITY_SHOWN;
 }
 
 
 
 
 
-bool checkCollisionVillain(Villain &v){
-  return  (v.visible && p->cb->checkCollision(*(v.cb)) );
-}
-
 void simulateCollisionVillain(){
   sound.setBuffer(villainBuffer);
   sound.play();
@@ -1665,14 +4331,24 @@ void simulateCollisionVillain(){
   p->setPosition(0.0f,6.0f,0.0f);
 }
 
+vector<int> nearby; // simulation side, scratch for grid queries
+vector<int> hits;
+
+/* The handlers below only test what the broadphase puts near the player or
+   the bullet, in one batched kernel call each: the sweep and prune pairs
+   for villains, which move, the grid for bonuses and tiles, which do not,
+   and the grid around its whole path for the bullet, which is swept (see
+   handleCollisionBullet). Everything else in the store is never touched. */
 void handleCollisionVillain(){
-  for(int i = 0; i < villainList.size(); i++){
-    if(checkCollisionVillain(*villainList[i]))
+  int player = p->cb->getEntity();
+  entities.pairedWith(player, nearby);
+  entities.collide(player, nearby, ENTITY_VILLAIN | ENTITY_SHOWN, hits);
+  // The first hit sends the player back to the start, away from the others
+  if(!hits.empty())
       {
         cout<<"Collision happened:Villain"<<endl;
         simulateCollisionVillain();
       }
-  }
 }
 
 void checkWinCollision(){
@@ -1680,41 +4356,46 @@ void checkWinCollision(){
 		winFlag = true; 
 }
 
-bool checkCollisionBonus(Bonus &b){
-   if(b.visible)
-    return p->cb->checkCollision(*(b.cb));
-  else return false;
-}
-
-void simulateCollisionBonus(Bonus &b){
-  score++;	
-  sound.setBuffer(bonusBuffer);
-  sound.play();
-  b.setVisible(false);
-}
-
 void handleCollisionBonus(){
-  for(int i = 0; i < bonusList.size(); i++){
-    if(checkCollisionBonus(*bonusList[i]))
+  int player = p->cb->getEntity();
+  entities.query(player, nearby);
+  entities.collide(player, nearby, ENTITY_BONUS | ENTITY_SHOWN, hits);
+  for(int k = 0; k < hits.size(); k++)
       {
         //cout<<"Collision happened: Bonus"<<endl;
-        simulateCollisionBonus(*bonusList[i]);
+        score++;
+        sound.setBuffer(bonusBuffer);
+        sound.play();
+        entities.flags[hits[k]] &= ~ENTITY_SHOWN;
       }
-  }
 }
 
+/* Swept along the whole move of the tick, so a fast bullet cannot jump a
+   villain between two ticks. The grid gives what lies near the path, the
+   kernel drops what is off its bounding box, then each is swept. */
 void handleCollisionBullet(){
-	for(int i = 0; i < villainList.size(); i++){
-		if(bt->cb->checkCollision( *(villainList[i]->cb) ) && villainList[i]->alive && villainList[i]->visible ){
-			villainList[i]->visible = false;
-			villainList[i]->alive = false;
-			cout<<"Bullet HIT!!"<<endl;
-		}
+	const uint32_t target = ENTITY_VILLAIN | ENTITY_ALIVE | ENTITY_SHOWN;
+	int bullet = bt->cb->getEntity();
+	// An idle bullet is harmless. It used to stay parked where it left the
+	// board and kill villains that walked into it.
+	if(!bt->inFlight)return;
+	float end[6], start[6], path[6], villain[6], t;
+	entities.boundsOf(bullet, end);
+	glm::vec3 move = glm::vec3(entities.x[bullet], entities.y[bullet], entities.z[bullet]) - bt->from;
+	for(int a = 0; a < 3; a++){
+		start[a] = end[a] - move[a];
+		start[a + 3] = end[a + 3] - move[a];
+		path[a] = min(start[a], end[a]);
+		path[a + 3] = max(start[a + 3], end[a + 3]);
+	}
+	entities.queryBox(path, nearby);
+	entities.collide(path, nearby, target, hits);
+	for(int k = 0; k < hits.size(); k++){
+		entities.boundsOf(hits[k], villain);
+		if(!sweepBox(start, move.x, move.y, move.z, villain, t))continue;
+		entities.flags[hits[k]] &= ~(ENTITY_ALIVE | ENTITY_SHOWN);
+		cout<<"Bullet HIT!!"<<endl;
 	}
-}
-
-bool checkCollisionMovingTile(Cuboid &cbd){
-	return p->cb->checkCollision(cbd);
 }
 
 void simulateCollisionMovingTile(){
@@ -1730,8 +4411,11 @@ void simulateCollisionMovingTile(){
 }
 
 void handleCollisionMovingTile(){
-	for(int i = 0; i < tilesList.size(); i++){
-		if(tilesList[i]->isSliding() && checkCollisionMovingTile(*tilesList[i]) && p->getPosY() < tilesList[i]->getHeight()/2.0f + p->cb->getHeight() && p->getPosY() > 0.0f){
+	int player = p->cb->getEntity();
+	entities.query(player, nearby);
+	for(int k = 0; k < nearby.size(); k++){
+		int i = nearby[k];
+		if((entities.flags[i] & ENTITY_SLIDING) && entities.overlaps(player, i) && p->getPosY() < entities.halfY[i] + p->cb->getHeight() && p->getPosY() > 0.0f){
 			//cout<<"Collision Happened"<<endl;
 			simulateCollisionMovingTile();
 		}
@@ -1751,15 +4435,44 @@ float rectangle_rot_dir = 1;
 bool triangle_rot_status = true;
 bool rectangle_rot_status = true;
 
-/* Executed when a regular key is pressed/released/held-down */
-/* Prefered for Keyboard events */
-void keyboard (GLFWwindow* window, int key, int scancode, int action, int mods)
+/* Keys that change the game state, they go through the input queue */
+bool isGameKey (int key)
 {
-     // Function is called first on GLFW_PRESS.
+    switch (key) {
+        case GLFW_KEY_UP:
+        case GLFW_KEY_DOWN:
+        case GLFW_KEY_LEFT:
+        case GLFW_KEY_RIGHT:
+        case GLFW_KEY_SPACE:
+        case GLFW_KEY_L:
+        case GLFW_KEY_R:
+        case GLFW_KEY_F:
+        case GLFW_KEY_S:
+            return true;
+        default:
+            return false;
+    }
+}
 
+/* Any thread */
+void queueGameInput (int key, int action)
+{
+    GameInput input;
+    input.key = key;
+    input.action = action;
+    pthread_mutex_lock(&inputMutex);
+    pendingInput.push_back(input);
+    pthread_mutex_unlock(&inputMutex);
+}
+
+/* Simulation side, a queued key or click */
+void gameInput (int key, int action)
+{
     if (action == GLFW_RELEASE) {
         switch (key) {
-          cout<<"Key release"<<endl;
+          case INPUT_FIRE:
+              bt->fire();
+              break;
           case GLFW_KEY_LEFT:
                 p->setDynamic(false);
                 break;
@@ -1778,10 +4491,6 @@ void keyboard (GLFWwindow* window, int key, int scancode, int action, int mods)
     }
     else if (action == GLFW_PRESS) {
         switch (key) {
-          cout<<"Key pressed"<<endl;
-            case GLFW_KEY_ESCAPE:
-                quit(window);
-                break;
             case GLFW_KEY_UP:
                 p->setDynamic(true);
                 p->enableMoveRight();
@@ -1817,6 +4526,40 @@ void keyboard (GLFWwindow* window, int key, int scancode, int action, int mods)
             case GLFW_KEY_S:
               p->decreaseSpeed();
               break;
+            default:
+                break;
+        }
+    }
+}
+
+/* Simulation side, everything queued since the last tick in order */
+void applyGameInput ()
+{
+    static vector<GameInput> inputs;
+    pthread_mutex_lock(&inputMutex);
+    inputs.swap(pendingInput);
+    pthread_mutex_unlock(&inputMutex);
+    for(int i = 0; i < inputs.size(); i++)
+        gameInput(inputs[i].key, inputs[i].action);
+    inputs.clear();
+}
+
+/* Executed when a regular key is pressed/released/held-down */
+/* Prefered for Keyboard events */
+void keyboard (GLFWwindow* window, int key, int scancode, int action, int mods)
+{
+     // Function is called first on GLFW_PRESS.
+
+    if (isGameKey(key)) {
+        queueGameInput(key, action);
+        return;
+    }
+    if (action == GLFW_PRESS) {
+        switch (key) {
+          cout<<"Key pressed"<<endl;
+            case GLFW_KEY_ESCAPE:
+                quit(window);
+                break;
             case GLFW_KEY_F1:
               viewMode = 0;
               break;
@@ -1832,6 +4575,20 @@ void keyboard (GLFWwindow* window, int key, int scancode, int action, int mods)
             case GLFW_KEY_F5:
               viewMode = 4;
               break;
+            case GLFW_KEY_G:
+              cout<<"GL state calls last frame: issued "<<glState.lastIssued<<", skipped "<<glState.lastSkipped<<endl;
+              cout<<"Objects last frame: drawn "<<cullStats.lastDrawn<<", culled "<<cullStats.lastCulled<<endl;
+              break;
+            case GLFW_KEY_P:
+              profiler.toggleOverlay();
+              break;
+            case GLFW_KEY_B:
+              backgroundCacheEnabled = !backgroundCacheEnabled;
+              break;
+            case GLFW_KEY_O:
+              profiler.dump("profile.csv");
+              profiler.dump("profile.json");
+              break;
 
 
             default:
@@ -1877,7 +4634,7 @@ void scrollCallback(GLFWwindow* window, double xoffset, double yoffset)
 
 void checkPan(GLFWwindow* window){
 	double xpos, ypos;
-	if(panFlag){
+	if(panFlag && window != NULL){
 		glfwGetCursorPos(window, &xpos, &ypos);
 		if((float)ypos > prevY)cameraRotationAngle += 3.5f;
 		else if((float)ypos < prevY)cameraRotationAngle -= 3.5f;
@@ -1892,9 +4649,7 @@ void mouseButton (GLFWwindow* window, int button, int action, int mods)
     switch (button) {
         case GLFW_MOUSE_BUTTON_LEFT:
             if (action == GLFW_RELEASE){
-            	bt->fire();
-               
-           
+            	queueGameInput(INPUT_FIRE, GLFW_RELEASE);
             }
             break;
 
@@ -1924,7 +4679,8 @@ void reshapeWindow (GLFWwindow* window, int width, int height)
     int fbwidth=width, fbheight=height;
     /* With Retina display on Mac OS X, GLFW's FramebufferSize
      is different from WindowSize */
-    glfwGetFramebufferSize(window, &fbwidth, &fbheight);
+    if(window != NULL)
+        glfwGetFramebufferSize(window, &fbwidth, &fbheight);
 
 	GLfloat fov = 90.0f;
 
@@ -1938,6 +4694,7 @@ void reshapeWindow (GLFWwindow* window, int width, int height)
 	// Store the projection matrix in a variable for future use
     // Perspective projection for 3D views
      Matrices.projection = glm::perspective (fov, (GLfloat) fbwidth / (GLfloat) fbheight, 0.1f, 500.0f);
+     backgroundCache.resize(fbwidth, fbheight);
 
     // Ortho projection for 2D views
   // Matrices.projection = glm::ortho(-4.0f, 4.0f, -4.0f, 4.0f, 0.1f, 500.0f);
@@ -2166,18 +4923,13 @@ float triangle_rotation = 0;
 
 void createScene(){
   int i,j;
-  GLuint textureId = createTexture("tile1.png");
+  GLuint textureId = acquireTexture("tile1.png");
   // check for an error during the load process
   if(textureId == 0 )
     cout << "SOIL loading error: '" << SOIL_last_result() << "'" << endl;
   time_t t;
   srand((unsigned) time(&t));
 
-  GLuint textureWaterId = createTexture("water2.png");
-  // check for an error during the load process
-  if(textureWaterId == 0 )
-    cout << "SOIL loading error: '" << SOIL_last_result() << "'" << endl;
-
   float *colorCube = new float[3];
   colorCube[0] = 0;
   colorCube[1] = 1;//0.412;
@@ -2232,76 +4984,32 @@ void createScene(){
   tilesList[37]->setEmpty(true);
 
 
-  //Water area bottom
-  posX = 0.0f - 3*width;
-  posZ = 0.0f - length;
-  for(i = 0; i < NUM_TILES_ROW; i++){
-    for(j = 0; j < NUM_TILES_COL + 6; j++){
-      temp_cuboid = new Cuboid(&Matrices, textureWaterId, colorCube, posX, 0.0f, posZ, length, width, height, 0);
-      waterList.push_back(temp_cuboid);
-      posX += width;
-    }
-    posX = 0.0f - 3*width;
-    posZ -= length;
-  }
-
-  //Water area top
-  posX = 0.0f - 3*width;
-  posZ = 0.0f + length * (NUM_TILES_ROW);
-  for(i = 0; i < NUM_TILES_ROW; i++){
-    for(j = 0; j < NUM_TILES_COL + 6; j++){
-      temp_cuboid = new Cuboid(&Matrices, textureWaterId, colorCube, posX, 0.0f, posZ, length, width, height, 0);
-      waterList.push_back(temp_cuboid);
-      posX += width;
-    }
-    posX = 0.0f - 3*width;
-    posZ += length;
-  }
-
-  //Water area left
-  posX = 0.0f - width;
-  posZ = 0.0f;
-  for(i = 0; i < 3; i++){
-    for(j = 0; j < NUM_TILES_ROW + 1; j++){
-      temp_cuboid = new Cuboid(&Matrices, textureWaterId, colorCube, posX, 0.0f, posZ, length, width, height, 0);
-      waterList.push_back(temp_cuboid);
-      posZ += length;
-    }
-    posZ = 0.0f;
-    posX -= width;
-  }
-
-  //Water area right
-  posX = 0.0f + width * (NUM_TILES_COL);
-  posZ = 0.0f;
-  for(i = 0; i < 3; i++){
-    for(j = 0; j < NUM_TILES_ROW + 1; j++){
-      temp_cuboid = new Cuboid(&Matrices, textureWaterId, colorCube, posX, 0.0f, posZ, length, width, height, 0);
-      waterList.push_back(temp_cuboid);
-      posZ += length;
-    }
-    posZ = 0.0f;
-    posX += width;
+  // Still tiles are meshed as a grid, sliding tiles stay instanced
+  vector<Cuboid*> slidingTiles;
+  boardMesh = new BoardMesh(&Matrices, tilesList);
+  for(i = 0; i < tilesList.size(); i++){
+    if(tilesList[i]->isSliding())slidingTiles.push_back(tilesList[i]);
   }
+  buildInstancedBatches(&Matrices, slidingTiles);
 
-
+  waterPlane = new WaterPlane(&Matrices, acquireTexture("water1.png"), acquireTexture("water2.png"));
 
   delete[] colorCube;
 }
 
-void drawScene(){
+void submitScene(bool board){
   int i;
-  for(i = 0; i < NUM_TILES_ROW * NUM_TILES_COL; i++){
-    if(tilesList[i]->isVisible())tilesList[i]->draw();
-  }
-  for(i = 0; i < waterList.size(); i++){
-    waterList[i]->draw();
+  if(board)boardMesh->submit();
+  waterPlane->submit();
+  // Sliding tiles go out as one instanced draw per mesh/texture pair
+  for(i = 0; i < sceneBatches.size(); i++){
+    sceneBatches[i]->submit();
   }
   for(i = 0; i < villainList.size(); i++){
-    villainList[i]->draw();
+    villainList[i]->submit();
   }
   for(i = 0; i < bonusList.size(); i++){
-    bonusList[i]->draw();
+    bonusList[i]->submit();
     //cout<<"Bonus drawn:-> "<<i<<endl;
   }
 
@@ -2313,15 +5021,38 @@ void draw ()
 {
   // clear the color and depth in the frame buffer
   glClear (GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+  profiler.beginFrame();
+
+  // Everything below reads the game through this snapshot only
+  static double shownUpdateMs = 0.0;
+  static int shownScore = 0; // the label starts as "Score:0"
+  frontSnapshot = snapshots.acquire();
+  if(simThread.isRunning()){
+    // Blend across the tick that follows the latest snapshot
+    renderAlpha = (currentTime() - frontSnapshot->time) / frontSnapshot->tickLength;
+    if(renderAlpha > 1.0f)renderAlpha = 1.0f;
+    if(renderAlpha < 0.0f)renderAlpha = 0.0f;
+  }
+  profiler.addScopeTime(SCOPE_UPDATE, frontSnapshot->updateMs - shownUpdateMs);
+  shownUpdateMs = frontSnapshot->updateMs;
+  // Only a changed score is formatted and laid out again
+  if(frontSnapshot->score != shownScore){
+    char scoreText[TextLabel::MAX_LENGTH + 1];
+    shownScore = frontSnapshot->score;
+    sprintf(scoreText, "Score:%d", shownScore);
+    scoreLabel->setText(scoreText);
+  }
 
   // use the loaded shader program
   // Don't change unless you know what you are doing
   //glUseProgram (programID);
-    glUseProgram(textureProgramID);
+  beginGLStateFrame();
+  stateUseProgram(textureProgramID);
 
   glm::vec3 eye;
   glm::vec3 target;
   glm::vec3 up( 0, 1, 0);
+  glm::vec3 body = p->getRenderPosition(renderAlpha);
 
   float offsetX;
   float offsetY;
@@ -2329,8 +5060,8 @@ void draw ()
 
 
   if(viewMode == 0){
-    eye = glm::vec3( p->getPosX() - 4.0f, p->getPosY() + 6.0f, p->getPosZ() - 4.0f);
-    target = glm::vec3(p->getPosX(), p->getPosY(), p->getPosZ());
+    eye = body + glm::vec3(-4.0f, 6.0f, -4.0f);
+    target = body;
   }
   else if(viewMode == 1){
     eye = glm::vec3( -5, 23, -5);
@@ -2341,7 +5072,7 @@ void draw ()
     target = glm::vec3(TILE_WIDTH * NUM_TILES_ROW/2.0f -1, 0, TILE_LENGTH * NUM_TILES_COL/2.0f - 1);
   }
   else if(viewMode == 3){
-  	char lastKey = p->getLastKey(); 
+  	char lastKey = frontSnapshot->lastKey;
   	if(lastKey == 'T'){
   		offsetX = 3.0f;
   	}
@@ -2354,8 +5085,8 @@ void draw ()
   	else if(lastKey == 'R'){
   		offsetZ = 3.0f;
   	}
-  	eye = glm::vec3(p->getHeadX(), p->getHeadY(), p->getHeadZ());
-  	target = glm::vec3(p->getHeadX() + offsetX, p->getHeadY(), p->getHeadZ() + offsetZ);
+  	eye = body + frontSnapshot->headOffset;
+  	target = eye + glm::vec3(offsetX, 0.0f, offsetZ);
   }
   else if(viewMode == 4){
   	//  glm::vec3 eye ( 5*cos(camera_rotation_angle*M_PI/180.0f), 3, 5*sin(camera_rotation_angle*M_PI/180.0f) );
@@ -2374,6 +5105,11 @@ void draw ()
   // Compute ViewProject matrix as view/camera might not be changed for this frame (basic scenario)
   //  Don't change unless you are sure!!
   glm::mat4 VP = Matrices.projection * Matrices.view;
+  updateCameraBuffer(&Matrices, Matrices.projection, Matrices.view);
+  viewFrustum = extractFrustum(VP);
+  cullStats.lastDrawn = cullStats.drawn;
+  cullStats.lastCulled = cullStats.culled;
+  cullStats.drawn = cullStats.culled = 0;
 
   // Send our transformation to the currently bound shader, in the "MVP" uniform
   // For each model you render, since the MVP will be different (at least the M part)
@@ -2398,13 +5134,30 @@ void draw ()
 */
 
   //cb->draw();
-  drawScene();
-  winBlock->draw();
-  p->draw();
-  bt->draw();
-
-  glUseProgram(fontProgramID);
-  f1->draw();
+  // The tower and top cameras never move, their view of the board is cached
+  bool cachedBoard = backgroundCacheEnabled && (viewMode == 1 || viewMode == 2) && backgroundCache.prepare();
+  profiler.beginScope(SCOPE_SUBMIT);
+  renderQueue.clear();
+  objectTransforms.beginFrame();
+  submitScene(!cachedBoard);
+  winBlock->submit();
+  p->submit();
+  bt->submit();
+  renderQueue.submit(makeRenderKey(PASS_HUD, fontProgramID, hudFont->getTextureID(), 0, 0.0f), fontProgramID, RENDER_FONT, scoreLabel);
+  profiler.submitOverlay();
+
+  objectTransforms.endFrame();
+  profiler.endScope(SCOPE_SUBMIT);
+
+  profiler.beginScope(SCOPE_SORT);
+  renderQueue.sort();
+  profiler.endScope(SCOPE_SORT);
+  profiler.beginScope(SCOPE_FLUSH);
+  if(cachedBoard)
+    backgroundCache.composite(viewMode, frontSnapshot->staticVersion);
+  renderQueue.flush();
+  objectTransforms.fenceFrame();
+  profiler.endScope(SCOPE_FLUSH);
 
 
 
@@ -2416,6 +5169,149 @@ void draw ()
   rectangle_rotation = rectangle_rotation + increments*rectangle_rot_dir*rectangle_rot_status;
 }
 
+/* Time one box against 'boxes' scattered boxes: the per pair test the
+   handlers used before, then every overlap kernel this CPU runs. CPU only. */
+void benchmarkCollision(int boxes, int repeats)
+{
+  EntityStore store;
+  int i, r, query, expected = 0;
+  srand(1);
+  query = store.create(0.0f, 0.0f, 0.0f, 4.0f, 4.0f, 4.0f).index;
+  for(i = 0; i < boxes; i++)
+    store.create(rand() % 4000 / 10.0f - 200.0f, 0.0f, rand() % 4000 / 10.0f - 200.0f, 2.0f, 2.0f, 2.0f);
+
+  cout<<"Collision benchmark: "<<boxes<<" boxes, "<<repeats<<" runs each"<<endl;
+  double start = currentTime();
+  for(r = 0; r < repeats; r++){
+    expected = 0;
+    for(i = 1; i <= boxes; i++)
+      if(store.overlaps(query, i))expected++;
+  }
+  double perPair = (currentTime() - start) / repeats;
+  cout<<"  per pair: "<<perPair*1000.0<<" ms, "<<expected<<" hits"<<endl;
+
+  AabbBatch batch;
+  for(i = 1; i <= boxes; i++)
+    batch.add(i, store.x[i] - store.halfX[i], store.y[i] - store.halfY[i], store.z[i] - store.halfZ[i],
+              store.x[i] + store.halfX[i], store.y[i] + store.halfY[i], store.z[i] + store.halfZ[i]);
+  batch.pad();
+  float box[6] = {-2.0f, -2.0f, -2.0f, 2.0f, 2.0f, 2.0f};
+  vector<uint32_t> mask((boxes + 31) / 32);
+
+  vector<OverlapKernel> kernels;
+  vector<const char*> names;
+  kernels.push_back(overlapScalar);
+  names.push_back("scalar");
+#ifdef OVERLAP_SIMD_X86
+  __builtin_cpu_init();
+  if(__builtin_cpu_supports("sse2")){
+    kernels.push_back(overlapSSE);
+    names.push_back("sse2");
+  }
+  if(__builtin_cpu_supports("avx2")){
+    kernels.push_back(overlapAVX2);
+    names.push_back("avx2");
+  }
+#endif
+  for(int k = 0; k < kernels.size(); k++){
+    start = currentTime();
+    for(r = 0; r < repeats; r++)
+      kernels[k](box, batch, &mask[0]);
+    double elapsed = (currentTime() - start) / repeats;
+    int found = 0;
+    for(i = 0; i < mask.size(); i++)
+      found += __builtin_popcount(mask[i]);
+    cout<<"  "<<names[k]<<": "<<elapsed*1000.0<<" ms, "<<found<<" hits, "<<perPair/elapsed<<"x"
+        <<(found != expected ? " MISMATCH" : "")<<endl;
+  }
+}
+
+/* Compare the old unindexed 36 vertex cube with the indexed 24 + 36 one:
+   buffer sizes, and GPU time to draw the same instanced grid with each. */
+void benchmarkIndexedCube(int instances, int repeats)
+{
+  GLfloat vertex_buffer_data[CUBOID_VERTICES*3];
+  GLfloat texture_buffer_data[CUBOID_VERTICES*2];
+  GLushort index_buffer_data[CUBOID_INDICES];
+  GLfloat flat_vertex_data[CUBOID_INDICES*3];
+  GLfloat flat_texture_data[CUBOID_INDICES*2];
+  int i, k;
+
+  buildCuboidMeshData(TILE_LENGTH, TILE_WIDTH, TILE_HEIGHT, 1, vertex_buffer_data, texture_buffer_data, index_buffer_data);
+  // Expand back to one vertex per triangle corner, the layout Cuboid used to upload
+  for(i = 0; i < CUBOID_INDICES; i++){
+    for(k = 0; k < 3; k++)
+      flat_vertex_data[3*i + k] = vertex_buffer_data[3*index_buffer_data[i] + k];
+    for(k = 0; k < 2; k++)
+      flat_texture_data[2*i + k] = texture_buffer_data[2*index_buffer_data[i] + k];
+  }
+  VAO *variants[2];
+  variants[0] = create3DTexturedObject(GL_TRIANGLES, CUBOID_INDICES, flat_vertex_data, flat_texture_data, 0, GL_FILL);
+  variants[1] = create3DTexturedObject(GL_TRIANGLES, CUBOID_VERTICES, vertex_buffer_data, texture_buffer_data, CUBOID_INDICES, GL_UNSIGNED_SHORT, index_buffer_data, 0, GL_FILL);
+  const char *names[2] = {"unindexed", "indexed"};
+  int bytes[2];
+  bytes[0] = CUBOID_INDICES * 5 * sizeof(GLfloat);
+  bytes[1] = CUBOID_VERTICES * 5 * sizeof(GLfloat) + CUBOID_INDICES * sizeof(GLushort);
+
+  // Square grid of instances shared by both variants
+  int side = (int)ceil(sqrt((float)instances));
+  vector<GLfloat> offsets(4*instances);
+  for(i = 0; i < instances; i++){
+    offsets[4*i] = (i % side) * TILE_WIDTH;
+    offsets[4*i + 1] = 0.0f;
+    offsets[4*i + 2] = (i / side) * TILE_LENGTH;
+    offsets[4*i + 3] = 1.0f;
+  }
+  GLuint instanceBuffer;
+  glGenBuffers(1, &instanceBuffer);
+  glBindBuffer(GL_ARRAY_BUFFER, instanceBuffer);
+  glBufferData(GL_ARRAY_BUFFER, offsets.size()*sizeof(GLfloat), &offsets[0], GL_STATIC_DRAW);
+  for(i = 0; i < 2; i++){
+    stateBindVertexArray(variants[i]->VertexArrayID);
+    glVertexAttribPointer(3, 4, GL_FLOAT, GL_FALSE, 0, (void*)0);
+    glEnableVertexAttribArray(3);
+    glVertexAttribDivisor(3, 1);
+  }
+
+  float extent = side * TILE_WIDTH;
+  glm::mat4 view = glm::lookAt(glm::vec3(extent/2.0f, extent, extent/2.0f + 1.0f), glm::vec3(extent/2.0f, 0, extent/2.0f), glm::vec3(0,1,0));
+  updateCameraBuffer(&Matrices, glm::perspective(90.0f, 1.0f, 0.1f, extent * 2.0f), view);
+  stateUseProgram(textureInstancedProgramID);
+
+  GLuint query;
+  glGenQueries(1, &query);
+  cout<<"Cube benchmark: "<<instances<<" instances, "<<repeats<<" draws each"<<endl;
+  for(i = 0; i < 2; i++){
+    VAO *vao = variants[i];
+    GLuint64 total = 0;
+    stateBindVertexArray(vao->VertexArrayID);
+    for(int r = 0; r <= repeats; r++){
+      GLuint64 elapsed;
+      glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+      glBeginQuery(GL_TIME_ELAPSED, query);
+      if(vao->NumIndices > 0)
+        glDrawElementsInstanced(GL_TRIANGLES, vao->NumIndices, vao->IndexType, (void*)0, instances);
+      else
+        glDrawArraysInstanced(GL_TRIANGLES, 0, vao->NumVertices, instances);
+      glEndQuery(GL_TIME_ELAPSED);
+      glGetQueryObjectui64v(query, GL_QUERY_RESULT, &elapsed);
+      if(r > 0)total += elapsed; // the first draw is a warm up
+    }
+    cout<<"  "<<names[i]<<": "<<bytes[i]<<" bytes per mesh, "<<(total / (double)repeats) / 1.0e6<<" ms per draw"<<endl;
+  }
+
+  glDeleteQueries(1, &query);
+  glDeleteBuffers(1, &instanceBuffer);
+  for(i = 0; i < 2; i++){
+    glDeleteBuffers(1, &variants[i]->VertexBuffer);
+    glDeleteBuffers(1, &variants[i]->TextureBuffer);
+    if(variants[i]->IndexBuffer)glDeleteBuffers(1, &variants[i]->IndexBuffer);
+    glDeleteVertexArrays(1, &variants[i]->VertexArrayID);
+    delete variants[i];
+  }
+  invalidateGLState();
+}
+
 /* Initialise glfw window, I/O callbacks and the renderer to use */
 /* Nothing to Edit here */
 GLFWwindow* initGLFW (int width, int height)
@@ -2468,11 +5364,95 @@ GLFWwindow* initGLFW (int width, int height)
     return window;
 }
 
+/* Offscreen target of headless runs: an EGL context with no surface,
+   rendering into a framebuffer object instead of a window. */
+struct HeadlessContext {
+  EGLDisplay display;
+  EGLContext context;
+  GLuint framebuffer;
+  GLuint colorBuffer;
+  GLuint depthBuffer;
+};
+
+HeadlessContext headless;
+
+bool initEGL (int width, int height)
+{
+    // Prefer a surfaceless display, it needs neither X nor a GPU with Mesa
+    headless.display = EGL_NO_DISPLAY;
+    PFNEGLGETPLATFORMDISPLAYEXTPROC getPlatformDisplay = (PFNEGLGETPLATFORMDISPLAYEXTPROC) eglGetProcAddress("eglGetPlatformDisplayEXT");
+    if(getPlatformDisplay != NULL)
+        headless.display = getPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, NULL);
+    if(headless.display == EGL_NO_DISPLAY)
+        headless.display = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+    EGLint major, minor;
+    if(headless.display == EGL_NO_DISPLAY || !eglInitialize(headless.display, &major, &minor)){
+        cout << "EGL: no display" << endl;
+        return false;
+    }
+    if(!eglBindAPI(EGL_OPENGL_API)){
+        cout << "EGL: desktop OpenGL not supported" << endl;
+        return false;
+    }
+
+    const EGLint configAttribs[] = {
+        EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT,
+        EGL_SURFACE_TYPE, 0,
+        EGL_NONE
+    };
+    EGLConfig config;
+    EGLint numConfigs = 0;
+    eglChooseConfig(headless.display, configAttribs, &config, 1, &numConfigs);
+    const EGLint contextAttribs[] = {
+        EGL_CONTEXT_MAJOR_VERSION, 3,
+        EGL_CONTEXT_MINOR_VERSION, 3,
+        EGL_CONTEXT_OPENGL_PROFILE_MASK, EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT,
+        EGL_NONE
+    };
+    // Surfaceless contexts do not need a config
+    headless.context = eglCreateContext(headless.display, numConfigs > 0 ? config : (EGLConfig)0, EGL_NO_CONTEXT, contextAttribs);
+    if(headless.context == EGL_NO_CONTEXT ||
+       !eglMakeCurrent(headless.display, EGL_NO_SURFACE, EGL_NO_SURFACE, headless.context)){
+        cout << "EGL: could not create a surfaceless OpenGL 3.3 core context" << endl;
+        return false;
+    }
+    gladLoadGLLoader((GLADloadproc) eglGetProcAddress);
+
+    glGenFramebuffers(1, &headless.framebuffer);
+    glBindFramebuffer(GL_FRAMEBUFFER, headless.framebuffer);
+    glGenRenderbuffers(1, &headless.colorBuffer);
+    glBindRenderbuffer(GL_RENDERBUFFER, headless.colorBuffer);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, width, height);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, headless.colorBuffer);
+    glGenRenderbuffers(1, &headless.depthBuffer);
+    glBindRenderbuffer(GL_RENDERBUFFER, headless.depthBuffer);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, width, height);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, headless.depthBuffer);
+    if(glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE){
+        cout << "EGL: offscreen framebuffer incomplete" << endl;
+        return false;
+    }
+    return true;
+}
+
+/* Patrolling villains blink every 15s and turn every 5s */
 void applyForcesVillains(float timeInstance){
-	for(int i = 0; i < villainList.size(); i++){
-		villainList[i]->applyForces(timeInstance);
+	const uint32_t patrol = ENTITY_ALIVE | ENTITY_PATROLS;
+	for(int i = 0; i < entities.size(); i++){
+		uint32_t &flags = entities.flags[i];
+		if((flags & patrol) != patrol)continue;
+		entities.blinkTime[i] += timeInstance;
+		entities.turnTime[i] += timeInstance;
+		if(entities.blinkTime[i] >= 15.0f){
+			flags ^= ENTITY_SHOWN;
+			entities.blinkTime[i] = 0.0f;
+		}
+		if(entities.turnTime[i] >= 5.0f){
+			entities.velX[i] *= -1.0f;
+			entities.turnTime[i] = 0.0f;
+		}
+		entities.x[i] += entities.velX[i]*timeInstance;
 	}
-
 }
 
 /* Initialize the OpenGL rendering properties */
@@ -2481,20 +5461,26 @@ void initGL (GLFWwindow* window, int width, int height)
 {
   // Load Textures
   // Enable Texture0 as current texture memory
+  invalidateGLState();
   glActiveTexture(GL_TEXTURE0);
+  // Decode every texture of the level up front, in parallel
+  const char *startupTextures[] = {"tile1.png", "water1.png", "water2.png", "gift.png", "box.png", "oandb.png", "gold.png", "lava.png"};
+  TextureLoader loader;
+  loader.load(startupTextures, sizeof(startupTextures)/sizeof(startupTextures[0]));
+  loader.report();
   // load an image file directly as a new OpenGL texture
   // GLuint texID = SOIL_load_OGL_texture ("beach.png", SOIL_LOAD_AUTO, SOIL_CREATE_NEW_ID, SOIL_FLAG_TEXTURE_REPEATS); // Buggy for OpenGL3
-  GLuint textureIdTile = createTexture("tile1.png");
+  GLuint textureIdTile = acquireTexture("tile1.png");
   // check for an error during the load process
   if(textureIdTile == 0 )
     cout << "SOIL loading error: '" << SOIL_last_result() << "'" << endl;
 
-  GLuint textureIdWater = createTexture("water1.png");
+  GLuint textureIdWater = acquireTexture("water1.png");
   // check for an error during the load process
   if(textureIdWater == 0 )
     cout << "SOIL loading error: '" << SOIL_last_result() << "'" << endl;
 
-  GLuint textureIdWin = createTexture("gift.png");
+  GLuint textureIdWin = acquireTexture("gift.png");
   // check for an error during the load process
   if(textureIdWin == 0 )
     cout << "SOIL loading error: '" << SOIL_last_result() << "'" << endl;
@@ -2505,8 +5491,17 @@ void initGL (GLFWwindow* window, int width, int height)
 
   // Create and compile our GLSL program from the texture shaders
   textureProgramID = LoadShaders( "TextureRender.vert", "TextureRender.frag" );
-  // Get a handle for our "MVP" uniform
-  Matrices.TexMatrixID = glGetUniformLocation(textureProgramID, "MVP");
+  // Instanced variant used for the sliding tiles
+  textureInstancedProgramID = LoadShaders( "TextureInstanced.vert", "TextureRender.frag" );
+
+  // Both read the camera from one uniform buffer, models come from the transform buffer
+  createCameraBuffer(&Matrices);
+  bindCameraBlock(textureProgramID);
+  bindCameraBlock(textureInstancedProgramID);
+  waterProgramID = LoadShaders( "Water.vert", "Water.frag" );
+  bindCameraBlock(waterProgramID);
+  backgroundProgramID = LoadShaders( "Background.vert", "Background.frag" );
+  objectTransforms.create(256);
     /* Objects should be created before any other gl function and shaders */
 	// Create the models
 	//createCube();
@@ -2565,22 +5560,17 @@ void initGL (GLFWwindow* window, int width, int height)
 
 	fontProgramID = LoadShaders( "fontrender.vert", "fontrender.frag" );
 
-	fontVertexCoordAttrib = glGetAttribLocation(fontProgramID, "vertexPosition");
-	fontVertexNormalAttrib = glGetAttribLocation(fontProgramID, "vertexNormal");
-	fontVertexOffsetUniform = glGetUniformLocation(fontProgramID, "pen");
-
 	float colArrayFont[3];
 	colArrayFont[0] = 0;
 	colArrayFont[1] = 0;
 	colArrayFont[2] = 0;
 
-	char fileString[20]; 
-	strcpy(fileString, "kimberly.ttf");
+	hudFont = new GlyphAtlas("kimberly.ttf", 20);
+	scoreLabel = new TextLabel(&Matrices, hudFont, colArrayFont, 10.0f, 35.0f, -30.0f, 1.0f);
+	scoreLabel->setText("Score:0");
 
-	char wordName[50];
-	strcpy(wordName, "Score");
-
-	f1 = new FTGLFont(&Matrices, colArrayFont, fileString, wordName, 20.0f, 10.0f, 35.0f, -30.0f, 1.0f); 
+	profiler.init();
+	profiler.createOverlay(hudFont);
 
 
 
@@ -2590,10 +5580,335 @@ void initGL (GLFWwindow* window, int width, int height)
     cout << "GLSL: " << glGetString(GL_SHADING_LANGUAGE_VERSION) << endl;
 }
 
+/* One simulation step of timeInstance seconds. Simulation side: no GL,
+   the renderer sees the results through the next snapshot. */
+void updateGame (float timeInstance)
+{
+    undergoSliding();
+    p->applyForces(timeInstance);
+    bt->applyForces(timeInstance);
+    applyForcesVillains(timeInstance);
+    entities.updateGrid();
+    handleCollisionMovingTile();
+    entities.sweep(); // after the moving tiles have carried the player
+    handleCollisionVillain();
+    handleCollisionBonus();
+    handleCollisionBullet();
+    checkWinCollision();
+    if(lives == -1)looseFlag = true;
+}
+
+double updateMsTotal = 0.0; // simulation side, time spent in updateGame
+double simTimeTotal = 0.0;
+
+/* Simulation side, copy out what rendering needs */
+void captureSnapshot (WorldSnapshot &snapshot, double tickLength)
+{
+    int i, n = entities.getSlotCount();
+    snapshot.time = currentTime();
+    snapshot.tickLength = tickLength;
+    snapshot.updateMs = updateMsTotal;
+    snapshot.simTime = simTimeTotal;
+    captureStates(snapshot.current);
+    // Entities that did not exist at the start of the tick do not blend
+    snapshot.previous = simPrevious;
+    snapshot.previous.resize(n);
+    for(i = 0; i < n; i++)
+      if(i >= simPrevious.size() || !simPrevious[i].drawn)
+        snapshot.previous[i] = snapshot.current[i];
+    snapshot.headOffset = glm::vec3(p->getHeadX() - p->getPosX(), p->getHeadY() - p->getPosY(), p->getHeadZ() - p->getPosZ());
+    snapshot.lastKey = p->getLastKey();
+    snapshot.score = score;
+    snapshot.won = winFlag;
+    snapshot.lost = looseFlag;
+    snapshot.staticVersion = staticGeometryVersion;
+}
+
+void publishSnapshot (double tickLength)
+{
+    captureSnapshot(snapshots.back(), tickLength);
+    snapshots.publish();
+}
+
+/* One tick of the simulation, whichever thread runs it */
+void simulationTick (double tickLength)
+{
+    applyGameInput();
+    storeSimState();
+    double start = currentTime();
+    updateGame(tickLength);
+    updateMsTotal += (currentTime() - start) * 1000.0;
+    simTimeTotal += tickLength;
+    publishSnapshot(tickLength);
+}
+
+SimThread::SimThread(){
+  running = false;
+  stopRequested = false;
+  ticks = droppedTicks = 0;
+  pthread_mutex_init(&mutex, NULL);
+}
+
+/* The simulation belongs to the thread from here until stop() */
+void SimThread::start(double tickRate, int maxSteps){
+  tickLength = 1.0 / tickRate;
+  this->maxSteps = maxSteps;
+  storeSimState();
+  publishSnapshot(tickLength);
+  stopRequested = false;
+  running = pthread_create(&thread, NULL, threadMain, this) == 0;
+}
+
+void SimThread::stop(){
+  if(!running)return;
+  pthread_mutex_lock(&mutex);
+  stopRequested = true;
+  pthread_mutex_unlock(&mutex);
+  pthread_join(thread, NULL);
+  running = false;
+  cout << "Simulation: " << ticks << " ticks, " << droppedTicks << " dropped" << endl;
+}
+
+bool SimThread::isRunning(){
+  return running;
+}
+
+void* SimThread::threadMain(void *arg){
+  ((SimThread*)arg)->run();
+  return NULL;
+}
+
+/* Ticks on a schedule of deadlines, at most maxSteps in a row when late.
+   Beyond that whole ticks are dropped, the schedule keeps its phase. */
+void SimThread::run(){
+  double next = currentTime() + tickLength;
+  while(true){
+    pthread_mutex_lock(&mutex);
+    bool stopping = stopRequested;
+    pthread_mutex_unlock(&mutex);
+    if(stopping)break;
+
+    double now = currentTime();
+    if(now < next){
+      struct timespec wait;
+      double seconds = next - now;
+      wait.tv_sec = (time_t)seconds;
+      wait.tv_nsec = (long)((seconds - wait.tv_sec) * 1e9);
+      nanosleep(&wait, NULL);
+      continue;
+    }
+    int steps = 0;
+    while(now >= next && steps < maxSteps){
+      if(!winFlag && !looseFlag){
+        simulationTick(tickLength);
+        ticks++;
+      }
+      next += tickLength;
+      steps++;
+    }
+    if(now >= next){
+      long behind = (long)((now - next) / tickLength) + 1;
+      droppedTicks += behind;
+      next += behind * tickLength;
+    }
+  }
+}
+
+/* Fixed rate simulation: frame time goes into an accumulator that is spent
+   in whole ticks, at most maxSteps per frame so a long stall cannot snowball.
+   What is left over sets renderAlpha, to draw between the last two states. */
+class SimClock{
+public:
+  SimClock(double tickRate, int maxSteps);
+  void advance(double frameTime);
+  long getTicks();
+  long getDroppedTicks();
+private:
+  double tickLength;
+  int maxSteps;
+  double accumulator;
+  long ticks;
+  long droppedTicks; // given up to the catch-up cap
+};
+
+SimClock::SimClock(double tickRate, int maxSteps){
+  tickLength = 1.0 / tickRate;
+  this->maxSteps = maxSteps;
+  accumulator = 0.0;
+  ticks = droppedTicks = 0;
+  storeSimState();
+  publishSnapshot(tickLength);
+}
+
+/* Ticks on the calling thread, each one still publishes its snapshot */
+void SimClock::advance(double frameTime){
+  accumulator += frameTime;
+  int steps = 0;
+  while(accumulator >= tickLength && steps < maxSteps && !winFlag && !looseFlag){
+    simulationTick(tickLength);
+    accumulator -= tickLength;
+    steps++;
+    ticks++;
+  }
+  if(accumulator >= tickLength){
+    // Too far behind, drop whole ticks but keep the phase
+    long behind = (long)(accumulator / tickLength);
+    droppedTicks += behind;
+    accumulator -= behind * tickLength;
+  }
+  renderAlpha = accumulator / tickLength;
+}
+
+long SimClock::getTicks(){
+  return ticks;
+}
+
+long SimClock::getDroppedTicks(){
+  return droppedTicks;
+}
+
+/* Scripted input for headless runs: at frame 'frame', feed 'action' of
+   'key' to the same callbacks GLFW would call. */
+struct ScriptEvent {
+  int frame;
+  int action; // GLFW_PRESS, GLFW_RELEASE, or SCRIPT_CLICK
+  int key;
+};
+
+const int SCRIPT_CLICK = -1;
+
+/* Walk around, look from every camera, jump and fire */
+const ScriptEvent defaultScript[] = {
+  {  0, GLFW_PRESS, GLFW_KEY_UP },     { 90, GLFW_RELEASE, GLFW_KEY_UP },
+  { 100, GLFW_PRESS, GLFW_KEY_SPACE }, { 101, GLFW_RELEASE, GLFW_KEY_SPACE },
+  { 120, SCRIPT_CLICK, 0 },
+  { 150, GLFW_PRESS, GLFW_KEY_RIGHT }, { 240, GLFW_RELEASE, GLFW_KEY_RIGHT },
+  { 300, GLFW_PRESS, GLFW_KEY_F2 },    { 301, GLFW_RELEASE, GLFW_KEY_F2 },
+  { 400, GLFW_PRESS, GLFW_KEY_F3 },    { 401, GLFW_RELEASE, GLFW_KEY_F3 },
+  { 500, GLFW_PRESS, GLFW_KEY_F4 },    { 501, GLFW_RELEASE, GLFW_KEY_F4 },
+  { 600, GLFW_PRESS, GLFW_KEY_F1 },    { 601, GLFW_RELEASE, GLFW_KEY_F1 }
+};
+
+/* Script files hold one event per line: "<frame> press|release|click [key]",
+   key being a letter, a digit, up, down, left, right, space or f1..f12. */
+bool loadScript (const char *filename, vector<ScriptEvent> &script)
+{
+    std::ifstream in(filename, std::ios::in);
+    if(!in.is_open())return false;
+    string action, key;
+    ScriptEvent event;
+    while(in >> event.frame >> action){
+        event.key = 0;
+        if(action == "click"){
+            event.action = SCRIPT_CLICK;
+            script.push_back(event);
+            continue;
+        }
+        event.action = action == "press" ? GLFW_PRESS : GLFW_RELEASE;
+        in >> key;
+        for(int i = 0; i < key.size(); i++)key[i] = toupper(key[i]);
+        if(key.size() == 1)event.key = key[0]; // GLFW key codes of letters and digits are ASCII
+        else if(key == "UP")event.key = GLFW_KEY_UP;
+        else if(key == "DOWN")event.key = GLFW_KEY_DOWN;
+        else if(key == "LEFT")event.key = GLFW_KEY_LEFT;
+        else if(key == "RIGHT")event.key = GLFW_KEY_RIGHT;
+        else if(key == "SPACE")event.key = GLFW_KEY_SPACE;
+        else if(key[0] == 'F')event.key = GLFW_KEY_F1 + atoi(key.c_str() + 1) - 1;
+        else{
+            cout << "Script: unknown key " << key << endl;
+            return false;
+        }
+        script.push_back(event);
+    }
+    return in.eof();
+}
+
+/* Render 'frames' frames offscreen as fast as possible, feeding the script
+   and simulating 1/60 s per frame, then print frame time statistics. */
+void runHeadless (int frames, const vector<ScriptEvent> &script, const char *dumpFile, SimClock &clock)
+{
+    const double frameDuration = 1.0/60.0;
+    vector<double> frameTimes;
+    frameTimes.reserve(frames);
+    int next = 0;
+    double start = currentTime();
+    for(int frame = 0; frame < frames && !winFlag && !looseFlag; frame++){
+        for(; next < script.size() && script[next].frame <= frame; next++){
+            if(script[next].action == SCRIPT_CLICK)
+                mouseButton(NULL, GLFW_MOUSE_BUTTON_LEFT, GLFW_RELEASE, 0);
+            else
+                keyboard(NULL, script[next].key, 0, script[next].action, 0);
+        }
+
+        // Simulated time, so runs are repeatable whatever the machine's speed
+        clock.advance(frameDuration);
+
+        double frameStart = currentTime();
+        draw();
+        glFinish(); // no swap to wait on, so wait for the GPU to count its time
+        frameTimes.push_back(currentTime() - frameStart);
+    }
+    double total = currentTime() - start;
+
+    if(frameTimes.empty())return;
+    vector<double> sorted(frameTimes);
+    std::sort(sorted.begin(), sorted.end());
+    double sum = 0.0;
+    for(int i = 0; i < sorted.size(); i++)sum += sorted[i];
+    int n = sorted.size();
+    printf("Headless: %d frames in %.3f s (%.1f fps)\n", n, total, n / total);
+    printf("  frame ms: min %.3f  mean %.3f  median %.3f  p95 %.3f  p99 %.3f  max %.3f\n",
+           sorted[0]*1000.0, sum/n*1000.0, sorted[n/2]*1000.0,
+           sorted[(int)(n*0.95)]*1000.0, sorted[(int)(n*0.99)]*1000.0, sorted[n-1]*1000.0);
+    printf("  simulation: %ld ticks, %ld dropped\n", clock.getTicks(), clock.getDroppedTicks());
+    if(winFlag)cout << "  stopped early: won" << endl;
+    if(looseFlag)cout << "  stopped early: lost" << endl;
+
+    if(dumpFile != NULL){
+        // Last frame as a binary PPM, rows flipped to top down
+        GLint viewport[4];
+        glGetIntegerv(GL_VIEWPORT, viewport);
+        int width = viewport[2], height = viewport[3];
+        vector<unsigned char> pixels(width * height * 3);
+        glPixelStorei(GL_PACK_ALIGNMENT, 1);
+        glReadPixels(0, 0, width, height, GL_RGB, GL_UNSIGNED_BYTE, &pixels[0]);
+        std::ofstream out(dumpFile, std::ios::out | std::ios::binary);
+        out << "P6\n" << width << " " << height << "\n255\n";
+        for(int row = height - 1; row >= 0; row--)
+            out.write((const char*)&pixels[row * width * 3], width * 3);
+    }
+}
+
 int main (int argc, char** argv)
 {
 	int width = 600;
 	int height = 600;
+	bool benchIndexed = false;
+	bool benchCollision = false;
+	int headlessFrames = 0;
+	const char *scriptFile = NULL;
+	const char *dumpFile = NULL;
+	double tickRate = 20.0; // gameplay constants are tuned per tick at this rate
+	int maxCatchUp = 5;
+	for(int i = 1; i < argc; i++){
+		if(strcmp(argv[i], "--bench-indexed") == 0)benchIndexed = true;
+		else if(strcmp(argv[i], "--bench-collision") == 0)benchCollision = true;
+		else if(strcmp(argv[i], "--headless") == 0 && i + 1 < argc)headlessFrames = atoi(argv[++i]);
+		else if(strcmp(argv[i], "--script") == 0 && i + 1 < argc)scriptFile = argv[++i];
+		else if(strcmp(argv[i], "--dump-frame") == 0 && i + 1 < argc)dumpFile = argv[++i];
+		else if(strcmp(argv[i], "--profile") == 0 && i + 1 < argc)profileDumpFile = argv[++i];
+		else if(strcmp(argv[i], "--tick-rate") == 0 && i + 1 < argc)tickRate = atof(argv[++i]);
+		else if(strcmp(argv[i], "--max-catchup") == 0 && i + 1 < argc)maxCatchUp = atoi(argv[++i]);
+	}
+	if(tickRate <= 0.0 || maxCatchUp < 1){
+		cout << "--tick-rate must be positive and --max-catchup at least 1" << endl;
+		return -1;
+	}
+	selectOverlapKernel();
+	if(benchCollision){
+		benchmarkCollision(100000, 200);
+		return 0;
+	}
 	score = 0;
 	looseFlag = winFlag = false;
 	lives = 3;
@@ -2603,74 +5918,82 @@ int main (int argc, char** argv)
     viewMode = 0;
     cameraRotationAngle = 0.0f;
 
-    if (!bonusBuffer.loadFromFile("bonus.ogg"))
+    assetPack.open("assets.pack");
+
+    if (!loadSound(bonusBuffer, "bonus.ogg"))
     {
     	cout<<"Bonus sound not loaded";
     	return -1;
     }
 
-    if (!villainBuffer.loadFromFile("villain.ogg"))
+    if (!loadSound(villainBuffer, "villain.ogg"))
     {
     	cout<<"Villain sound not loaded";
     	return -1;
     }
 
+    if(headlessFrames > 0){
+        vector<ScriptEvent> script;
+        if(scriptFile == NULL)
+            script.assign(defaultScript, defaultScript + sizeof(defaultScript)/sizeof(defaultScript[0]));
+        else if(!loadScript(scriptFile, script)){
+            cout << "Could not read script " << scriptFile << endl;
+            return -1;
+        }
+        if(!initEGL(width, height))
+            return -1;
+        initGL (NULL, width, height);
+        SimClock clock(tickRate, maxCatchUp);
+        runHeadless(headlessFrames, script, dumpFile, clock);
+        quit(NULL);
+    }
+
     GLFWwindow* window = initGLFW(width, height);
 
 	initGL (window, width, height);
 
-    double last_update_time = glfwGetTime(), current_time;
+	if(benchIndexed){
+		benchmarkIndexedCube(100000, 50);
+		quit(window);
+	}
 
-    char str[50];
-    char strB[50];
+    simThread.start(tickRate, maxCatchUp);
+    double last_pan_time = currentTime(), current_time;
 	
 
     /* Draw in loop */
     while (!glfwWindowShouldClose(window)) {
 
-    	if(winFlag){
+    	const WorldSnapshot *latest = snapshots.acquire();
+    	if(latest->won){
     		cout<<"You won !! :-) "<<endl;
 			quit(window);
     	}
 
-    	if(looseFlag){
+    	if(latest->lost){
     		cout<<"You Loose :-( "<<endl;
     			quit(window);
     	}
 
-        // OpenGL Draw commands
-        draw();
-
-        // Swap Frame Buffer in double buffering
-        glfwSwapBuffers(window);
-
         // Poll for Keyboard and mouse events
         glfwPollEvents();
 
-        // Control based on time (Time based transformation like 5 degrees rotation every 0.5s)
-        current_time = glfwGetTime(); // Time in seconds
-        if ((current_time - last_update_time) >= 0.05f) { // atleast 0.5s elapsed since last frame
-            // do something every 0.5 seconds ..
-            last_update_time = current_time;
-            strcpy(strB,"Score:");
-            undergoSliding();
-            p->applyForces(0.05f);
-            bt->applyForces(0.05f);
-            applyForcesVillains(0.05f);
-            handleCollisionMovingTile();
-            handleCollisionVillain();
-            handleCollisionBonus();
-            handleCollisionBullet();
-            checkWinCollision();
+        // Panning turns the camera a fixed step, at the rate it always had
+        current_time = currentTime(); // Time in seconds
+        if(current_time - last_pan_time >= 1.0 / tickRate){
             checkPan(window);
-            sprintf(str, "%d", score);   
-  			strcat(strB,str);
- 			f1->setWord(strB);
- 			if(lives == -1)looseFlag = true;
+            last_pan_time = current_time;
         }
+
+        // OpenGL Draw commands
+        draw();
+
+        // Swap Frame Buffer in double buffering
+        glfwSwapBuffers(window);
     }
     //cout<<"Your Score "<<p->getScore()<<endl;
 
+    simThread.stop();
     glfwTerminate();
     exit(EXIT_SUCCESS);
 }
@@ -0,0 +1,171 @@
+/* Bakes the game's loose asset files into one pack (see asset_pack.h).
+
+   Usage: asset_baker <output.pack> <file>...
+
+   Images are decoded here once and stored with their full mip chain, so
+   the game only uploads. Shaders, sounds and fonts are copied as is. */
+#include <iostream>
+#include <fstream>
+#include <vector>
+#include <string>
+#include <cstring>
+#include <cstdlib>
+#include <stdint.h>
+
+#include <SOIL/SOIL.h>
+
+#include "asset_pack.h"
+
+using namespace std;
+
+bool hasExtension(const string &name, const char *ext)
+{
+  size_t n = strlen(ext);
+  return name.size() >= n && name.compare(name.size() - n, n, ext) == 0;
+}
+
+bool readFile(const char *path, vector<unsigned char> &data)
+{
+  ifstream in(path, ios::in | ios::binary);
+  if(!in.is_open())return false;
+  in.seekg(0, ios::end);
+  data.resize((size_t)in.tellg());
+  in.seekg(0, ios::beg);
+  if(!data.empty())
+    in.read((char*)&data[0], data.size());
+  return in.good();
+}
+
+/* Halve an RGB8 image with a 2x2 box filter, odd edges are clamped */
+void downsample(const unsigned char *src, uint32_t width, uint32_t height, unsigned char *dst)
+{
+  uint32_t w = width > 1 ? width/2 : 1, h = height > 1 ? height/2 : 1;
+  for(uint32_t y = 0; y < h; y++){
+    uint32_t y0 = 2*y < height ? 2*y : height-1, y1 = 2*y+1 < height ? 2*y+1 : height-1;
+    for(uint32_t x = 0; x < w; x++){
+      uint32_t x0 = 2*x < width ? 2*x : width-1, x1 = 2*x+1 < width ? 2*x+1 : width-1;
+      for(int c = 0; c < 3; c++){
+        int sum = src[(y0*width + x0)*3 + c] + src[(y0*width + x1)*3 + c] +
+                  src[(y1*width + x0)*3 + c] + src[(y1*width + x1)*3 + c];
+        dst[(y*w + x)*3 + c] = (unsigned char)((sum + 2) / 4);
+      }
+    }
+  }
+}
+
+bool bakeTexture(const char *path, PackEntry &entry, vector<unsigned char> &data)
+{
+  int width, height;
+  unsigned char *image = SOIL_load_image(path, &width, &height, 0, SOIL_LOAD_RGB);
+  if(image == NULL){
+    cout << "SOIL loading error: '" << SOIL_last_result() << "'" << endl;
+    return false;
+  }
+  entry.width = width;
+  entry.height = height;
+  entry.levels = 1;
+  while((width >> entry.levels) > 0 || (height >> entry.levels) > 0)
+    entry.levels++;
+
+  uint64_t total = 0;
+  for(uint32_t level = 0; level < entry.levels; level++)
+    total += packLevelSize(width, height, level);
+  data.resize(total);
+  memcpy(&data[0], image, packLevelSize(width, height, 0));
+  SOIL_free_image_data(image);
+
+  uint64_t offset = 0;
+  for(uint32_t level = 1; level < entry.levels; level++){
+    uint64_t previous = packLevelSize(width, height, level-1);
+    uint32_t w = width >> (level-1), h = height >> (level-1);
+    downsample(&data[offset], w ? w : 1, h ? h : 1, &data[offset + previous]);
+    offset += previous;
+  }
+  return true;
+}
+
+int main(int argc, char **argv)
+{
+  if(argc < 3){
+    cout << "Usage: " << argv[0] << " <output.pack> <file>..." << endl;
+    return EXIT_FAILURE;
+  }
+
+  int count = argc - 2;
+  vector<PackEntry> entries(count);
+  vector< vector<unsigned char> > payloads(count);
+  for(int i = 0; i < count; i++){
+    const char *path = argv[i + 2];
+    string name = path;
+    PackEntry &entry = entries[i];
+    memset(&entry, 0, sizeof(entry));
+    if(name.size() >= (size_t)PACK_NAME_LENGTH){
+      cout << "Name too long for the pack: " << name << endl;
+      return EXIT_FAILURE;
+    }
+    strcpy(entry.name, path);
+
+    bool ok;
+    if(hasExtension(name, ".png") || hasExtension(name, ".jpg") || hasExtension(name, ".bmp") || hasExtension(name, ".tga")){
+      entry.type = PACK_TEXTURE;
+      ok = bakeTexture(path, entry, payloads[i]);
+    }
+    else{
+      if(hasExtension(name, ".vert") || hasExtension(name, ".frag"))
+        entry.type = PACK_SHADER;
+      else if(hasExtension(name, ".ogg") || hasExtension(name, ".wav") || hasExtension(name, ".flac"))
+        entry.type = PACK_AUDIO;
+      else if(hasExtension(name, ".ttf") || hasExtension(name, ".otf"))
+        entry.type = PACK_FONT;
+      else{
+        cout << "Unknown asset type: " << name << endl;
+        return EXIT_FAILURE;
+      }
+      ok = readFile(path, payloads[i]);
+    }
+    if(!ok){
+      cout << "Could not bake " << name << endl;
+      return EXIT_FAILURE;
+    }
+    entry.size = payloads[i].size();
+  }
+
+  // Lay the payloads out after the entry table, each one aligned
+  uint64_t offset = sizeof(PackHeader) + count * sizeof(PackEntry);
+  for(int i = 0; i < count; i++){
+    offset = (offset + PACK_ALIGNMENT - 1) / PACK_ALIGNMENT * PACK_ALIGNMENT;
+    entries[i].offset = offset;
+    offset += entries[i].size;
+  }
+
+  ofstream out(argv[1], ios::out | ios::binary | ios::trunc);
+  if(!out.is_open()){
+    cout << "Could not open " << argv[1] << " for writing" << endl;
+    return EXIT_FAILURE;
+  }
+  PackHeader header;
+  header.magic = PACK_MAGIC;
+  header.version = PACK_VERSION;
+  header.entryCount = count;
+  header.reserved = 0;
+  out.write((const char*)&header, sizeof(header));
+  out.write((const char*)&entries[0], count * sizeof(PackEntry));
+  uint64_t written = sizeof(PackHeader) + count * sizeof(PackEntry);
+  for(int i = 0; i < count; i++){
+    static const char zeros[PACK_ALIGNMENT] = {0};
+    out.write(zeros, entries[i].offset - written);
+    if(entries[i].size > 0)
+      out.write((const char*)&payloads[i][0], entries[i].size);
+    written = entries[i].offset + entries[i].size;
+    cout << entries[i].name << ": " << entries[i].size << " bytes";
+    if(entries[i].type == PACK_TEXTURE)
+      cout << ", " << entries[i].width << "x" << entries[i].height << ", " << entries[i].levels << " levels";
+    cout << endl;
+  }
+  if(!out.good()){
+    cout << "Could not write " << argv[1] << endl;
+    return EXIT_FAILURE;
+  }
+  cout << "Wrote " << argv[1] << ": " << count << " assets, " << written << " bytes" << endl;
+  return EXIT_SUCCESS;
+}
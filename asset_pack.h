@@ -0,0 +1,51 @@
+/* Layout of assets.pack, written by asset_baker and memory mapped by the game.
+
+   header | entry table | payloads
+
+   Every payload starts on a PACK_ALIGNMENT boundary so it can be handed
+   to GL, SFML or FreeType straight from the mapping. Values are stored in
+   the byte order of the machine that baked the pack. */
+#ifndef ASSET_PACK_H
+#define ASSET_PACK_H
+
+#include <stdint.h>
+
+const uint32_t PACK_MAGIC = 0x4b504c41; // "ALPK"
+const uint32_t PACK_VERSION = 1;
+const uint32_t PACK_ALIGNMENT = 16;
+const int PACK_NAME_LENGTH = 48;
+
+enum PackAssetType {
+  PACK_TEXTURE = 1, // RGB8 mip chain, level 0 first, rows tightly packed
+  PACK_SHADER = 2,  // GLSL source, not NUL terminated
+  PACK_AUDIO = 3,   // encoded file as is, SFML decodes it from memory
+  PACK_FONT = 4     // font file as is, FreeType reads it from memory
+};
+
+struct PackHeader {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t entryCount;
+  uint32_t reserved;
+};
+
+struct PackEntry {
+  char name[PACK_NAME_LENGTH]; // file name the game asks for, NUL terminated
+  uint32_t type;
+  uint32_t width;  // textures only
+  uint32_t height; // textures only
+  uint32_t levels; // textures only
+  uint64_t offset; // from the start of the file
+  uint64_t size;
+};
+
+/* Bytes taken by mip level 'level' of a width x height RGB8 texture */
+inline uint64_t packLevelSize(uint32_t width, uint32_t height, uint32_t level)
+{
+  uint32_t w = width >> level, h = height >> level;
+  if(w == 0)w = 1;
+  if(h == 0)h = 1;
+  return (uint64_t)w * h * 3;
+}
+
+#endif
@@ -1,14 +1,17 @@
 #version 330 core
 
 // Interpolated values from the vertex shaders
-in vec3 fragColor;
+in vec2 fragTexCoord;
+
+// Glyph coverage in the red channel
+uniform sampler2D atlas;
+uniform vec3 fontColor;
 
 // output data
-out vec3 color;
+out vec4 color;
 
 void main()
 {
-    // Output color = color specified in the vertex shader,
-    // interpolated between all 3 surrounding vertices of the triangle
-    color = fragColor;
-}
\ No newline at end of file
+    // Text color everywhere, the atlas coverage becomes alpha for blending
+    color = vec4(fontColor, texture(atlas, fragTexCoord).r);
+}
@@ -1,17 +1,15 @@
 #version 330 core
 
-uniform mat4 MVP;
-uniform vec3 pen;
-uniform vec3 fontColor;
+// Glyph quad corner in font pixels, and its place in the glyph atlas
+layout (location = 0) in vec2 vertexPosition;
+layout (location = 1) in vec2 vertexTexCoord;
 
-in vec3 vertexPosition;
-in vec3 vertexNormal;
+uniform mat4 MVP;
 
-out vec3 fragColor;
+out vec2 fragTexCoord;
 
 void main ()
 {
-    gl_Position = MVP * (vec4(vertexPosition, 1.0) + vec4(pen, 1.0));
-    // fragColor = vec3((vertexNormal.x+1)/2,(vertexNormal.y+1)/2,(vertexNormal.z+1)/2);
-    fragColor = fontColor;
-}
\ No newline at end of file
+    gl_Position = MVP * vec4(vertexPosition, 0.0, 1.0);
+    fragTexCoord = vertexTexCoord;
+}